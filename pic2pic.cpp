@@ -2,9 +2,28 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 #include "lodepng.cpp"
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
 #define PIC_EGAPALETTE_SIZE  40
+#define PIC_EGAPALETTE_COUNT 4
 #define SCI_PATTERN_CODE_RECTANGLE 0x10
 #define SCI_PATTERN_CODE_USE_TEXTURE 0x20
 #define SCI_PATTERN_CODE_PENSIZE 0x07
@@ -14,21 +33,52 @@
 #define SCI_PICTURE_WIDTH 320
 #define SCI_PICTURE_HEIGHT 190
 
+#define AGI_Y_CORNER_INSTRUCTION 0xf4
+#define AGI_X_CORNER_INSTRUCTION 0xf5
 #define AGI_LINE_INSTRUCTION 0xf6
+#define AGI_RELATIVE_LINE_INSTRUCTION 0xf7
 #define AGI_SET_VISUAL 0xf0
 #define AGI_DISABLE_VISUAL 0xf1
 #define AGI_SET_PRIORITY 0xf2
 #define AGI_DISABLE_PRIORITY 0xf3
 #define AGI_FILL_INSTRUCTION 0xf8
+#define AGI_SET_PATTERN 0xf9
+#define AGI_PLOT_INSTRUCTION 0xfa
 
-int AGI_OFFSET_Y = 0;
+// The Y conversions use the agiOffsetY of the Converter they are expanded in
 #define SCI_TO_AGI_X(x) ((x) / 2)
-#define SCI_TO_AGI_Y(y) ((y) + AGI_OFFSET_Y)
+#define SCI_TO_AGI_Y(y) ((y) + agiOffsetY)
 #define AGI_TO_SCI_X(x) ((x) * 2)
-#define AGI_TO_SCI_Y(y) ((y) - AGI_OFFSET_Y)
+#define AGI_TO_SCI_Y(y) ((y) - agiOffsetY)
+
+#define MIN_AGI_OFFSET_Y (AGI_PICTURE_HEIGHT - SCI_PICTURE_HEIGHT)
+
+// How much a plug or an AGI pixel of clipped SCI picture counts against an
+// offset compared to a byte of output when -y auto picks one
+#define AUTO_OFFSET_PLUG_WEIGHT 3
+#define AUTO_OFFSET_CLIP_WEIGHT 1
 
 #define COLOUR_DISABLED 0xff
 
+#define FILL_MASK_WORDS ((AGI_PICTURE_WIDTH + 31) / 32)
+
+// Canvas rows are copied in pages of this many when a shared page is written to
+#define CANVAS_PAGE_ROWS 8
+
+// Overdraw elimination keeps a canvas of the full picture every this many ops
+#define OVERDRAW_CHECKPOINT_INTERVAL 16
+
+// Batch conversion keeps a converter snapshot every this many ops, and drops
+// the least recently used ones past this many
+#define PREFIX_CACHE_INTERVAL 16
+#define PREFIX_CACHE_MAX_SNAPSHOTS 1024
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+#define BLANK_VISUAL_PLANE 0
+#define BLANK_PRIORITY_PLANE 1
+
 using namespace std;
 
 uint8_t EGAPalette[] = 
@@ -51,6 +101,216 @@ uint8_t EGAPalette[] =
 	0xff, 0xff, 0xff
 };
 
+// What every SCI palette holds until the picture changes it. Each entry is a
+// pair of EGA colours, one per nibble, that SCI dithers together.
+const uint8_t defaultSciPalette[PIC_EGAPALETTE_SIZE] =
+{
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+	0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0x88,
+	0x88, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x88,
+	0x88, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff,
+	0x08, 0x91, 0x2a, 0x3b, 0x4c, 0x5d, 0x6e, 0x88
+};
+
+// The AGI colour nearest to each SCI colour pair seen from a distance
+uint8_t ditherToAgiColour[256];
+
+void InitDitherTable()
+{
+	for(int pair = 0; pair < 256; pair++)
+	{
+		int first = pair >> 4;
+		int second = pair & 0xf;
+		int bestDistance = -1;
+		
+		// Twice the average, so the pair's own colours win ties
+		for(int candidate : { first, second, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 })
+		{
+			int distance = 0;
+			for(int channel = 0; channel < 3; channel++)
+			{
+				int difference = EGAPalette[first * 3 + channel] + EGAPalette[second * 3 + channel] - 2 * EGAPalette[candidate * 3 + channel];
+				distance += difference * difference;
+			}
+			
+			if(bestDistance < 0 || distance < bestDistance)
+			{
+				bestDistance = distance;
+				ditherToAgiColour[pair] = (uint8_t) candidate;
+			}
+		}
+	}
+}
+
+// AGI brush shapes, one bit per pixel of the (size + 1) x (size * 2 + 1) box,
+// most significant bit first
+const uint8_t agiBrushCircles[8][15] =
+{
+	{ 0x80 },
+	{ 0xfc },
+	{ 0x5f, 0xf4 },
+	{ 0x66, 0xff, 0xf6, 0x60 },
+	{ 0x23, 0xbf, 0xff, 0xff, 0xee, 0x20 },
+	{ 0x31, 0xe7, 0x9e, 0xff, 0xff, 0xde, 0x79, 0xe3, 0x00 },
+	{ 0x38, 0xf9, 0xf3, 0xef, 0xff, 0xff, 0xff, 0xfe, 0xf9, 0xf3, 0xe3, 0x80 },
+	{ 0x18, 0x3c, 0x7e, 0x7e, 0x7e, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7e, 0x7e, 0x7e, 0x3c, 0x18 }
+};
+
+// Bit stream that textured brushes take pixels from, and where each of the
+// 128 textures starts in it
+const uint8_t agiBrushTexture[32] =
+{
+	0x20, 0x94, 0x02, 0x24, 0x90, 0x82, 0xa4, 0xa2,
+	0x82, 0x09, 0x0a, 0x22, 0x12, 0x10, 0x42, 0x14,
+	0x91, 0x4a, 0x91, 0x11, 0x08, 0x12, 0x25, 0x10,
+	0x22, 0xa8, 0x14, 0x24, 0x00, 0x50, 0x24, 0x04
+};
+
+const uint8_t agiBrushTextureStart[128] =
+{
+	0x00, 0x18, 0x30, 0xc4, 0xdc, 0x65, 0xeb, 0x48,
+	0x60, 0xbd, 0x89, 0x05, 0x0a, 0xf4, 0x7d, 0x7d,
+	0x85, 0xb0, 0x8e, 0x95, 0x1f, 0x22, 0x0d, 0xdf,
+	0x2a, 0x78, 0xd5, 0x73, 0x1c, 0xb4, 0x40, 0xa1,
+	0xb9, 0x3c, 0xca, 0x58, 0x92, 0x34, 0xcc, 0xce,
+	0xd7, 0x42, 0x90, 0x0f, 0x8b, 0x7f, 0x32, 0xed,
+	0x5c, 0x9d, 0xc8, 0x99, 0xad, 0x4e, 0x56, 0xa6,
+	0xf7, 0x68, 0xb7, 0x25, 0x82, 0x37, 0x3a, 0x51,
+	0x69, 0x26, 0x38, 0x52, 0x9e, 0x9a, 0x4f, 0xa7,
+	0x43, 0x10, 0x80, 0xee, 0x3d, 0x59, 0x35, 0xcf,
+	0x79, 0x74, 0xb5, 0xa2, 0xb1, 0x96, 0x23, 0xe0,
+	0xbe, 0x05, 0xf5, 0x6e, 0x19, 0xc5, 0x66, 0x49,
+	0xf0, 0xd1, 0x54, 0xa9, 0x70, 0x4b, 0xa4, 0xe2,
+	0xe6, 0xe5, 0xab, 0xe4, 0xd2, 0xaa, 0x4c, 0xe3,
+	0x06, 0x6f, 0xc6, 0x4a, 0xa4, 0x75, 0x97, 0xe1
+};
+
+// SCI brush shapes, one bit per pixel of the (size * 2 + 2) x (size * 2 + 1)
+// box, least significant bit first
+const uint8_t sciBrushCircles[8][30] =
+{
+	{ 0x01 },
+	{ 0x72, 0x02 },
+	{ 0xce, 0xf7, 0x7d, 0x0e },
+	{ 0x1c, 0x3e, 0x7f, 0x7f, 0x7f, 0x3e, 0x1c },
+	{ 0x38, 0xf8, 0xf3, 0xdf, 0x7f, 0xff, 0xfd, 0xf7, 0x9f, 0x3f, 0x38 },
+	{ 0x70, 0xc0, 0x1f, 0xfe, 0xe3, 0x3f, 0xff, 0xf7, 0x7f, 0xff, 0xe7, 0x3f, 0xfe, 0xc3, 0x1f, 0x70 },
+	{ 0xf0, 0x01, 0xff, 0xe1, 0xff, 0xf8, 0x3f, 0xff, 0xdf, 0xff, 0xf7, 0xff, 0xfd, 0x7f, 0xff, 0x9f, 0xff, 0xe3, 0xff, 0xf0, 0x1f, 0xf0, 0x01 },
+	{ 0xe0, 0x03, 0xf8, 0x0f, 0xfc, 0x1f, 0xfe, 0x3f, 0xfe, 0x3f, 0xfe, 0x3f, 0xff, 0x7f, 0xff, 0x7f, 0xff, 0x7f, 0xfe, 0x3f, 0xfe, 0x3f, 0xfe, 0x3f, 0xfc, 0x1f, 0xf8, 0x0f, 0xe0, 0x03 }
+};
+
+// The same texture bits as agiBrushTexture, least significant bit first. SCI
+// textures start at the same places in it as AGI ones.
+const uint8_t sciBrushTexture[32] =
+{
+	0x04, 0x29, 0x40, 0x24, 0x09, 0x41, 0x25, 0x45,
+	0x41, 0x90, 0x50, 0x44, 0x48, 0x08, 0x42, 0x28,
+	0x89, 0x52, 0x89, 0x88, 0x10, 0x48, 0xa4, 0x08,
+	0x44, 0x15, 0x28, 0x24, 0x00, 0x0a, 0x24, 0x20
+};
+
+#define BRUSH_NO_TEXTURE 128
+
+// Every AGI brush worked out up front: [rectangle][size][texture or
+// BRUSH_NO_TEXTURE][row], bit 0 being the leftmost pixel
+uint8_t brushStamps[2][8][BRUSH_NO_TEXTURE + 1][15];
+
+// The same for every SCI brush whose box is not clipped
+uint16_t sciBrushStamps[2][8][BRUSH_NO_TEXTURE + 1][15];
+
+// Works out the rows of an SCI brush drawn in a box width pixels wide. The
+// interpreter reads the shape bits in order across the box, so a box clipped
+// by the right edge of the picture shears the shape. A textured brush takes
+// the next texture bit for each SCI pixel it plots, going round the texture
+// bits again once it runs off the end.
+void GetSciBrushRows(int rectangle, int size, int texture, int width, uint16_t* rows)
+{
+	int circleBit = 0;
+	uint8_t textureBit = texture == BRUSH_NO_TEXTURE ? 0 : agiBrushTextureStart[texture];
+	
+	for(int y = 0; y <= size * 2; y++)
+	{
+		rows[y] = 0;
+		
+		for(int x = 0; x < width; x++)
+		{
+			bool inShape = rectangle || ((sciBrushCircles[size][circleBit >> 3] >> (circleBit & 7)) & 1);
+			circleBit++;
+			
+			if(!inShape)
+				continue;
+			
+			if(texture != BRUSH_NO_TEXTURE)
+			{
+				inShape = (sciBrushTexture[textureBit >> 3] >> (textureBit & 7)) & 1;
+				textureBit++;
+			}
+			
+			if(inShape)
+				rows[y] |= 1 << x;
+		}
+	}
+}
+
+void InitBrushStamps()
+{
+	for(int rectangle = 0; rectangle < 2; rectangle++)
+	{
+		for(int size = 0; size < 8; size++)
+		{
+			for(int texture = 0; texture <= BRUSH_NO_TEXTURE; texture++)
+			{
+				uint8_t* rows = brushStamps[rectangle][size][texture];
+				int circleBit = 0;
+				uint8_t textureBit = texture == BRUSH_NO_TEXTURE ? 0 : agiBrushTextureStart[texture];
+				
+				memset(rows, 0, 15);
+				
+				for(int y = 0; y <= size * 2; y++)
+				{
+					for(int x = 0; x <= size; x++)
+					{
+						bool inShape = rectangle || ((agiBrushCircles[size][circleBit >> 3] >> (7 - (circleBit & 7))) & 1);
+						circleBit++;
+						
+						if(!inShape)
+							continue;
+						
+						if(texture != BRUSH_NO_TEXTURE)
+						{
+							inShape = (agiBrushTexture[textureBit >> 3] >> (7 - (textureBit & 7))) & 1;
+							textureBit++;
+							if(textureBit == 0xff)
+								textureBit = 0;
+						}
+						
+						if(inShape)
+							rows[y] |= 1 << x;
+					}
+				}
+			}
+		}
+	}
+	
+	for(int rectangle = 0; rectangle < 2; rectangle++)
+	{
+		for(int size = 0; size < 8; size++)
+		{
+			for(int texture = 0; texture <= BRUSH_NO_TEXTURE; texture++)
+			{
+				GetSciBrushRows(rectangle, size, texture, size * 2 + 2, sciBrushStamps[rectangle][size][texture]);
+			}
+		}
+	}
+}
+
+// A view of bytes owned by something else
+struct ByteSpan
+{
+	const uint8_t* data;
+	size_t length;
+};
+
 struct Coord
 {
 	Coord() : x(0), y(0) {}
@@ -58,101 +318,559 @@ struct Coord
 	int x, y;
 };
 
+struct Plug
+{
+	Coord coord;
+	uint8_t visual;
+	uint8_t priority;
+};
+
 struct ControlLine
 {
 	Coord start, end;
 	uint8_t colour;
 };
 
+enum SciOpType
+{
+	SCI_OP_SET_VISUAL,
+	SCI_OP_DISABLE_VISUAL,
+	SCI_OP_SET_PRIORITY,
+	SCI_OP_DISABLE_PRIORITY,
+	SCI_OP_SET_CONTROL,
+	SCI_OP_DISABLE_CONTROL,
+	SCI_OP_SET_PATTERN,
+	SCI_OP_LINE,
+	SCI_OP_PATTERN,
+	SCI_OP_FILL,
+	SCI_OP_SET_PALETTE_ENTRY
+};
+
+// One decoded SCI picture operation. Coordinates are absolute and already
+// mirrored, so running a picture again never has to look at the byte stream.
+//   SCI_OP_LINE: x1, y1 - x2, y2
+//   SCI_OP_PATTERN: x1, y1 with value as the pattern texture
+//   SCI_OP_FILL: x1, y1
+//   SCI_OP_SET_PALETTE_ENTRY: x1 is the entry (palette * 40 + index), value the colour pair
+//   Colour and pattern ops: value
+struct SciOp
+{
+	uint8_t type;
+	uint8_t value;
+	int16_t x1, y1;
+	int16_t x2, y2;
+};
+
+// One instruction of an emitted AGI picture, as a range of the output bytes
+struct AgiOp
+{
+	uint8_t instruction;
+	int start;
+	int length;
+};
+
+// One brush plot, either waiting to be emitted or read back from the output
+struct AgiBrush
+{
+	uint8_t patternCode;
+	uint8_t texture;
+	int16_t x, y;
+};
+
+// One bit per AGI pixel, used to compare fill results without searching coord lists
+struct FillMask
+{
+	FillMask() { Clear(); }
+	
+	void Clear() { memset(rows, 0, sizeof(rows)); }
+	void Set(int x, int y);
+	void Reset(int x, int y);
+	bool Test(int x, int y);
+	
+	uint32_t rows[AGI_PICTURE_HEIGHT][FILL_MASK_WORDS];
+};
+
+// CANVAS_PAGE_ROWS rows of a canvas. Pixels are the visual colour in the low
+// nibble and priority in the high nibble. Each blank mask has one bit per
+// pixel, set while that plane still holds its blank colour, so fills can
+// test them a word at a time instead of checking each pixel.
+struct CanvasPage
+{
+	vector<uint8_t> pixels;
+	vector<uint32_t> blankMasks[2];
+};
+
+// Copying a canvas shares its pages, and either copy only gets its own
+// copy of a page when it first writes to it. That makes converter
+// snapshots cheap. The size is fixed at compile time, so row strides are
+// constants in every kernel.
+template<int Width, int Height>
 struct Canvas
 {
-	Canvas(int inWidth, int inHeight, uint8_t priorityBlank = 4, uint8_t visualBlank = 0xf);
-	~Canvas();
+	static constexpr int width = Width;
+	static constexpr int height = Height;
+	static constexpr int maskWords = (Width + 31) / 32;
+	static constexpr int numPages = (Height + CANVAS_PAGE_ROWS - 1) / CANVAS_PAGE_ROWS;
+	
+	Canvas(uint8_t priorityBlank = 4, uint8_t visualBlank = 0xf);
+	
+	const uint8_t* PixelRow(int y) const { return pixelRows[y]; }
+	const uint32_t* BlankMaskRow(int plane, int y) const { return blankMaskRows[plane][y + 1]; }
+	uint8_t* WritablePixelRow(int y);
+	uint32_t* WritableBlankMaskRow(int plane, int y);
+	CanvasPage& WritablePage(int y);
+	void SetRowPointers(int pageIndex);
 	
 	void SetPixel(int x, int y);
 	uint8_t GetVisualPixel(int x, int y);
 	uint8_t GetPriorityPixel(int x, int y);
 	
 	void DrawLine(int x1, int y1, int x2, int y2);
+	void StampRow(int left, int y, uint32_t bits);
 	void Fill(int x, int y, vector<Coord>* filled = nullptr);
-	void UndoFill();
 	bool OkToFill(int x, int y);
+	bool FillHasEffect();
+	int FillPlane();
 	
+	bool SamePixels(const Canvas& other) const;
 	void DumpToPNG(const char* visualFilename, const char* priorityFilename);
 	
-	int width, height;
+	shared_ptr<CanvasPage> pages[numPages];
 	
-	uint8_t* visualData;
-	uint8_t* priorityData;
+	// Where each row of the current pages is. The masks have an extra row
+	// above and below the canvas with nothing blank, so fills can look past
+	// the top and bottom edges without checking.
+	const uint8_t* pixelRows[Height];
+	const uint32_t* blankMaskRows[2][Height + 2];
+	static const uint32_t borderMaskRow[maskWords];
 	
-	uint8_t* lastVisualData;
-	uint8_t* lastPriorityData;
-			
 	uint8_t blankPriority;
 	uint8_t blankVisual;
+	
+	// Colours that drawing and filling write with
+	uint8_t penColour;
+	uint8_t priorityColour;
 };
 
+template<int Width, int Height> constexpr int Canvas<Width, Height>::width;
+template<int Width, int Height> constexpr int Canvas<Width, Height>::height;
+template<int Width, int Height> constexpr int Canvas<Width, Height>::maskWords;
+template<int Width, int Height> constexpr int Canvas<Width, Height>::numPages;
+template<int Width, int Height> const uint32_t Canvas<Width, Height>::borderMaskRow[maskWords] = {};
+
+typedef Canvas<AGI_PICTURE_WIDTH, AGI_PICTURE_HEIGHT> AgiCanvas;
+typedef Canvas<SCI_PICTURE_WIDTH, SCI_PICTURE_HEIGHT> SciCanvas;
+
+// Steps one pixel at a time along the longer axis, carrying the shorter axis
+// as an integer error term. Gives the same pixels as the AGI interpreter,
+// including rounding ties in the direction the line is drawn.
+template<typename PlotFunc>
+void RasterizeLine(int x1, int y1, int x2, int y2, PlotFunc plot)
+{
+	int width = abs(x2 - x1);
+	int height = abs(y2 - y1);
+	int stepX = x2 < x1 ? -1 : 1;
+	int stepY = y2 < y1 ? -1 : 1;
+	
+	if(width > height)
+	{
+		int error = width / 2;
+		int y = y1;
+		for(int x = x1; x != x2; x += stepX)
+		{
+			plot(x, y);
+			error += height;
+			if(error >= width)
+			{
+				error -= width;
+				y += stepY;
+			}
+		}
+	}
+	else
+	{
+		int error = height / 2;
+		int x = x1;
+		for(int y = y1; y != y2; y += stepY)
+		{
+			plot(x, y);
+			error += width;
+			if(error >= height)
+			{
+				error -= height;
+				x += stepX;
+			}
+		}
+	}
+	
+	plot(x2, y2);
+}
+
+// The interpreter moves a brush that would reach past the picture edges
+void ClampAgiBrush(int size, int& x, int& y)
+{
+	if(x < size / 2 + 1)
+		x = size / 2 + 1;
+	else if(x > AGI_PICTURE_WIDTH - (size / 2 + 1))
+		x = AGI_PICTURE_WIDTH - (size / 2 + 1);
+	
+	if(y < size)
+		y = size;
+	else if(y >= AGI_PICTURE_HEIGHT - size)
+		y = AGI_PICTURE_HEIGHT - 1 - size;
+}
+
+const uint8_t* GetBrushStamp(uint8_t patternCode, uint8_t texture)
+{
+	int rectangle = (patternCode & SCI_PATTERN_CODE_RECTANGLE) ? 1 : 0;
+	int size = patternCode & SCI_PATTERN_CODE_PENSIZE;
+	
+	return brushStamps[rectangle][size][(patternCode & SCI_PATTERN_CODE_USE_TEXTURE) ? texture & 0x7f : BRUSH_NO_TEXTURE];
+}
+
+// Draws a brush the way the AGI interpreter would, adding every pixel it
+// writes to written if given
+void DrawAgiBrush(AgiCanvas& canvas, uint8_t patternCode, uint8_t texture, int x, int y, vector<Coord>* written)
+{
+	int size = patternCode & SCI_PATTERN_CODE_PENSIZE;
+	const uint8_t* rows = GetBrushStamp(patternCode, texture);
+	
+	ClampAgiBrush(size, x, y);
+	
+	int left = x - (size + 1) / 2;
+	int top = y - size;
+	
+	for(int row = 0; row <= size * 2; row++)
+	{
+		canvas.StampRow(left, top + row, rows[row]);
+		
+		if(written)
+		{
+			for(int bit = 0; bit <= size; bit++)
+			{
+				if(rows[row] & (1 << bit))
+					written->push_back(Coord(left + bit, top + row));
+			}
+		}
+	}
+}
+
 uint8_t* pictureData;
 uint8_t* pictureDataPtr;
 long pictureDataLength;
 bool verbose = false;
+bool minimalPlugs = false;
 
-bool mirroredFlag = false;
-uint16_t patternCode;
+// Skip sealing fill leaks altogether, for quick previews
+bool fastMode = false;
 
-uint8_t penColour = 0xff;
-uint8_t priorityColour = 0xff;
-uint8_t controlColour = 0xff;
+// How many pixels sealing the fills of one picture may visit before the rest
+// of its fills are emitted unsealed, or 0 for no limit
+long workBudget = 0;
 
-uint8_t lastAgiInstruction = 0;
+bool mirroredFlag = false;
 
-FILE* outputFile;
+// State for converting one picture at one vertical offset. Separate instances
+// share nothing, so -y auto can run every offset at once. A copy taken between
+// ops is a snapshot that conversion can be resumed from, without running the
+// ops before it again. Its canvases share pages with the original until one
+// of them draws there. A snapshot is restored by copying it again, with the
+// copy constructor or Snapshot, and running on from the copy.
+struct Converter
+{
+	Converter(int offsetY);
+	
+	void Convert(vector<SciOp>& ops);
+	void RunOps(vector<SciOp>& ops, size_t last);
+	void Finish();
+	Converter* Snapshot();
+	int CountClippedPixels();
+	ByteSpan Output();
+	
+	void WriteByte(uint8_t value);
+	void EmitAgiInstruction(uint8_t instruction);
+	void EmitAgiFill(int16_t x, int16_t y);
+	void FlushFills();
+	void EmitAgiLine(int16_t x1, int16_t y1, int16_t x2, int16_t y2);
+	void FlushPolyline();
+	void EmitAgiSetVisual(uint8_t colour);
+	void EmitAgiSetPriority(uint8_t colour);
+	void EmitAgiDot(int16_t x, int16_t y);
+	void FlushDots();
+	void EmitAgiBrush(uint8_t code, uint8_t texture, int16_t x, int16_t y);
+	void FlushBrushes();
+	void EmitAgiPlugs(vector<Plug>& plugs, uint8_t fillColour, uint8_t fillPriority);
+	void EmitControlLines();
+	void EliminateOverdraw();
+	
+	void DrawLine(int16_t x1, int16_t y1, int16_t x2, int16_t y2);
+	void DrawPattern(int16_t x, int16_t y, uint8_t texture);
+	void SetVisualColour(uint8_t colour);
+	void DisableVisual();
+	void SetPriorityColour(uint8_t colour);
+	void DisablePriority();
+	void SetControlColour(uint8_t colour);
+	void DisableControl();
+	void SetPaletteEntry(int entry, uint8_t value);
+	void ExecuteSciOp(SciOp& op);
+	
+	void ProjectSciFill(vector<Coord>& sciFilled, FillMask& sciMask);
+	void FindLeaks(FillMask& sciMask, FillMask& visited, int agiX, int agiY, vector<Coord>& leaks, vector<Coord>& region);
+	void GetGapColours(Coord& coord, uint8_t fillColour, uint8_t fillPriority, uint8_t& visualGap, uint8_t& priorityGap);
+	void GreedyPlugs(vector<Coord>& leaks, uint8_t fillColour, uint8_t fillPriority, vector<Plug>& plugs);
+	bool SolveMinimalPlugs(vector<Coord>& region, vector<Coord>& leaks, Coord& seed, uint8_t fillColour, uint8_t fillPriority, vector<Plug>& plugs);
+	void TryFill(FillMask& sciMask, FillMask& visited, int16_t x, int16_t y);
+	void DoFill(int16_t x, int16_t y);
+	
+	int agiOffsetY;
+	
+	// How many of the picture's ops have been run
+	size_t opsRun;
+	
+	// The AGI picture is built up here and only written out once it is complete
+	vector<uint8_t> output;
+	
+	uint16_t patternCode;
+	
+	// Colour pairs that SCI colour numbers pick from, palette * 40 + index
+	uint8_t sciPalettes[PIC_EGAPALETTE_COUNT * PIC_EGAPALETTE_SIZE];
+	
+	uint8_t penColour;
+	uint8_t priorityColour;
+	uint8_t controlColour;
+	
+	// The last colour written with F0. pic2png refuses every fill while it is
+	// white, even once visual drawing is off again.
+	uint8_t lastVisualColour;
+	
+	// Joined lines waiting for FlushPolyline to pick their encoding
+	vector<Coord> polyline;
+	
+	// Single pixels in the current colours waiting for FlushDots
+	vector<Coord> dots;
+	
+	// Brushes in the current colours waiting for FlushBrushes to group them by pattern
+	vector<AgiBrush> brushes;
+	
+	// Fill seeds in the current colours waiting to share one fill instruction.
+	// Fills depend on what is already drawn, so these are never pending at the
+	// same time as dots or a polyline.
+	vector<Coord> fillSeeds;
+	uint8_t agiPatternCode;
+	
+	int plugCount;
+	int plugBytesSaved;
+	
+	// Fill work for the report, and for the budget
+	int fillCount;
+	int unsealedFills;
+	long pixelsVisited;
+	
+	AgiCanvas agiCanvas;
+	SciCanvas sciCanvas;
+	
+	vector<ControlLine> controlLines;
+};
 
-Canvas agiCanvas(AGI_PICTURE_WIDTH, AGI_PICTURE_HEIGHT);
-Canvas sciCanvas(SCI_PICTURE_WIDTH, SCI_PICTURE_HEIGHT);
+Converter::Converter(int offsetY) : 
+	agiOffsetY(offsetY), opsRun(0), patternCode(0),
+	penColour(COLOUR_DISABLED), priorityColour(COLOUR_DISABLED), controlColour(COLOUR_DISABLED), lastVisualColour(0),
+	agiPatternCode(0xff), plugCount(0), plugBytesSaved(0), fillCount(0), unsealedFills(0), pixelsVisited(0)
+{
+	for(int palette = 0; palette < PIC_EGAPALETTE_COUNT; palette++)
+	{
+		memcpy(sciPalettes + palette * PIC_EGAPALETTE_SIZE, defaultSciPalette, PIC_EGAPALETTE_SIZE);
+	}
+}
 
-vector<ControlLine> controlLines;
+void Converter::WriteByte(uint8_t value)
+{
+	output.push_back(value);
+}
 
-void WriteByte(uint8_t value)
+ByteSpan Converter::Output()
 {
-	fwrite(&value, 1, 1, outputFile);
+	ByteSpan span;
+	span.data = output.data();
+	span.length = output.size();
+	return span;
 }
 
-void EmitAgiInstruction(uint8_t instruction)
+void Converter::EmitAgiInstruction(uint8_t instruction)
 {
-	lastAgiInstruction = instruction;
+	FlushFills();
+	FlushDots();
+	FlushBrushes();
+	FlushPolyline();
 	WriteByte(instruction);
 }
 
-void EmitAgiFill(int16_t x, int16_t y)
+void Converter::EmitAgiFill(int16_t x, int16_t y)
 {
 	if(x >= 0 && y >= 0 && x < AGI_PICTURE_WIDTH && y < AGI_PICTURE_HEIGHT)
 	{
-		EmitAgiInstruction(AGI_FILL_INSTRUCTION);
-		WriteByte((uint8_t)(x));
-		WriteByte((uint8_t)(y));
+		// A priority only fill after white would be refused by pic2png but not
+		// by Canvas, so some other visual colour is set and turned off first
+		if(penColour == COLOUR_DISABLED && priorityColour != COLOUR_DISABLED && lastVisualColour == 15)
+		{
+			EmitAgiSetVisual(0);
+			EmitAgiSetVisual(COLOUR_DISABLED);
+		}
+		
+		FlushDots();
+		FlushBrushes();
+		FlushPolyline();
+		fillSeeds.push_back(Coord(x, y));
 	}
 }
 
-void EmitAgiLine(int16_t x1, int16_t y1, int16_t x2, int16_t y2)
+void Converter::FlushFills()
 {
-	static int16_t lastX = 0xff, lastY = 0xff;
+	if(fillSeeds.size() == 0)
+		return;
+	
+	vector<Coord> seeds;
+	seeds.swap(fillSeeds);
+	
+	EmitAgiInstruction(AGI_FILL_INSTRUCTION);
+	for(Coord& seed : seeds)
+	{
+		WriteByte((uint8_t) seed.x);
+		WriteByte((uint8_t) seed.y);
+	}
+}
 
-	if(lastAgiInstruction != AGI_LINE_INSTRUCTION || lastX != x1 || lastY != y1)
+void Converter::EmitAgiLine(int16_t x1, int16_t y1, int16_t x2, int16_t y2)
+{
+	FlushFills();
+	
+	if(polyline.size() == 0 || polyline.back().x != x1 || polyline.back().y != y1)
 	{
-		EmitAgiInstruction(AGI_LINE_INSTRUCTION);	
-		WriteByte((uint8_t)(x1));
-		WriteByte((uint8_t)(y1));
+		FlushPolyline();
+		polyline.push_back(Coord(x1, y1));
 	}
+	
+	polyline.push_back(Coord(x2, y2));
+}
+
+// The step between two points as a relative line byte, or -1 if it is out of
+// range. A -7 x step would make the byte look like an instruction.
+int RelativeLineStep(Coord& from, Coord& to)
+{
+	int dx = to.x - from.x;
+	int dy = to.y - from.y;
+	
+	if(dx < -6 || dx > 7 || dy < -7 || dy > 7)
+		return -1;
+	
+	return (dx < 0 ? 0x80 | (-dx << 4) : dx << 4) | (dy < 0 ? 0x08 | -dy : dy);
+}
+
+// Every segment runs from one point to the next, so any opcode can take over
+// at any point. Finds the split into line, relative line and corner runs with
+// the fewest bytes; each segment keeps its direction so the pixels are the same.
+void Converter::FlushPolyline()
+{
+	if(polyline.size() == 0)
+		return;
+	
+	vector<Coord> points;
+	points.swap(polyline);
+	
+	int numPoints = (int) points.size();
+	vector<int> cost(numPoints, 0);
+	vector<int> runStart(numPoints, 0);
+	vector<uint8_t> runInstruction(numPoints, AGI_LINE_INSTRUCTION);
+	
+	for(int end = 1; end < numPoints; end++)
+	{
+		// Whether points start..end could be one run of each kind
+		bool relative = true;
+		bool yCorner = true;
+		bool xCorner = true;
+		
+		cost[end] = -1;
 		
-	WriteByte((uint8_t)(x2));
-	WriteByte((uint8_t)(y2));
+		for(int start = end - 1; start >= 0; start--)
+		{
+			Coord& from = points[start];
+			Coord& to = points[start + 1];
+			bool nextYCorner = from.x == to.x && xCorner;
+			bool nextXCorner = from.y == to.y && yCorner;
+			yCorner = nextYCorner;
+			xCorner = nextXCorner;
+			relative = relative && RelativeLineStep(from, to) != -1;
+			
+			int segments = end - start;
+			int lineCost = cost[start] + 1 + 2 * (segments + 1);
+			int shortCost = cost[start] + 3 + segments;
+			
+			if(cost[end] == -1 || lineCost < cost[end])
+			{
+				cost[end] = lineCost;
+				runStart[end] = start;
+				runInstruction[end] = AGI_LINE_INSTRUCTION;
+			}
+			if(shortCost < cost[end])
+			{
+				if(yCorner || xCorner || relative)
+				{
+					cost[end] = shortCost;
+					runStart[end] = start;
+					runInstruction[end] = yCorner ? AGI_Y_CORNER_INSTRUCTION : xCorner ? AGI_X_CORNER_INSTRUCTION : AGI_RELATIVE_LINE_INSTRUCTION;
+				}
+			}
+		}
+	}
+	
+	vector<int> runEnds;
+	for(int end = numPoints - 1; end > 0; end = runStart[end])
+	{
+		runEnds.push_back(end);
+	}
 	
-	lastX = x2;
-	lastY = y2;
+	if(runEnds.size() == 0)
+	{
+		// A lone point
+		runEnds.push_back(0);
+		runInstruction[0] = AGI_LINE_INSTRUCTION;
+	}
+	
+	for(int n = (int) runEnds.size() - 1; n >= 0; n--)
+	{
+		int end = runEnds[n];
+		int start = runStart[end];
+		uint8_t instruction = runInstruction[end];
+		
+		WriteByte(instruction);
+		WriteByte((uint8_t) points[start].x);
+		WriteByte((uint8_t) points[start].y);
+		
+		for(int i = start + 1; i <= end; i++)
+		{
+			bool firstAxis = (i - start) % 2 == 1;
+			
+			switch(instruction)
+			{
+				case AGI_LINE_INSTRUCTION:
+				WriteByte((uint8_t) points[i].x);
+				WriteByte((uint8_t) points[i].y);
+				break;
+				case AGI_RELATIVE_LINE_INSTRUCTION:
+				WriteByte((uint8_t) RelativeLineStep(points[i - 1], points[i]));
+				break;
+				case AGI_Y_CORNER_INSTRUCTION:
+				WriteByte((uint8_t) (firstAxis ? points[i].y : points[i].x));
+				break;
+				case AGI_X_CORNER_INSTRUCTION:
+				WriteByte((uint8_t) (firstAxis ? points[i].x : points[i].y));
+				break;
+			}
+		}
+	}
 }
 
-void EmitAgiSetVisual(uint8_t colour)
+void Converter::EmitAgiSetVisual(uint8_t colour)
 {
 	if(colour == penColour)
 	{
@@ -167,11 +885,13 @@ void EmitAgiSetVisual(uint8_t colour)
 	{
 		EmitAgiInstruction(AGI_SET_VISUAL);
 		WriteByte(colour);
+		lastVisualColour = colour;
 	}
 	penColour = colour;
+	agiCanvas.penColour = sciCanvas.penColour = colour;
 }
 
-void EmitAgiSetPriority(uint8_t colour)
+void Converter::EmitAgiSetPriority(uint8_t colour)
 {
 	if(colour == priorityColour)
 	{
@@ -188,44 +908,219 @@ void EmitAgiSetPriority(uint8_t colour)
 		WriteByte(colour);
 	}
 	priorityColour = colour;
+	agiCanvas.priorityColour = sciCanvas.priorityColour = colour;
 }
 
-void EmitAgiPixel(int16_t x, int16_t y, uint8_t visualColour, uint8_t priorityColour)
+void Converter::EmitAgiDot(int16_t x, int16_t y)
 {
-	EmitAgiSetVisual(visualColour);
-	EmitAgiSetPriority(priorityColour);
-	EmitAgiInstruction(AGI_LINE_INSTRUCTION);
-	WriteByte((uint8_t) x);
-	WriteByte((uint8_t) y);
-	WriteByte((uint8_t) x);
-	WriteByte((uint8_t) y);
+	FlushFills();
+	dots.push_back(Coord(x, y));
 }
 
-void DrawLine(int16_t x1, int16_t y1, int16_t x2, int16_t y2)
+// The dots all share the current colours, so they can be drawn in any order.
+// Runs of neighbouring dots become polylines, where each step only draws the
+// next dot, and the rest go in one plot instruction with a single pixel brush.
+// The brush is pushed right of x = 0, so those dots are drawn as lines.
+void Converter::FlushDots()
 {
-	sciCanvas.DrawLine(x1, y1, x2, y2);
-	
-	x1 = SCI_TO_AGI_X(x1);
-	y1 = SCI_TO_AGI_Y(y1);
-	x2 = SCI_TO_AGI_X(x2);
-	y2 = SCI_TO_AGI_Y(y2);
-	
-	// Clip
-	if(y1 < 0 && y2 < 0)
+	if(dots.size() == 0)
 		return;
 	
-	if(y1 >= 168 && y2 >= 168)
-		return;
+	vector<Coord> pending;
+	pending.swap(dots);
 	
-	if(y2 >= 168)
+	sort(pending.begin(), pending.end(), [](const Coord& a, const Coord& b) { return a.y != b.y ? a.y < b.y : a.x < b.x; });
+	
+	FillMask remaining;
+	for(Coord& dot : pending)
 	{
-		x2 = x1 + ((x2 - x1) * (167 - y1)) / (y2 - y1);
-//		x2 = x1 + ((x2 - x1) * 167) / y2;
-		y2 = 167;
+		remaining.Set(dot.x, dot.y);
 	}
-	if(y1 >= 168)
+	
+	static const int steps[8][2] = { {1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1}, {1, -1} };
+	vector<Coord> chain;
+	vector<Coord> plotted;
+	
+	for(Coord& dot : pending)
 	{
-		x1 = x2 + ((x1 - x2) * (167 - y2)) / (y1 - y2);
+		if(!remaining.Test(dot.x, dot.y))
+			continue;
+		
+		chain.clear();
+		chain.push_back(dot);
+		remaining.Reset(dot.x, dot.y);
+		
+		for(bool extended = true; extended; )
+		{
+			extended = false;
+			for(int n = 0; n < 8 && !extended; n++)
+			{
+				Coord next(chain.back().x + steps[n][0], chain.back().y + steps[n][1]);
+				if(next.x >= 0 && next.y >= 0 && next.x < AGI_PICTURE_WIDTH && next.y < AGI_PICTURE_HEIGHT && remaining.Test(next.x, next.y))
+				{
+					remaining.Reset(next.x, next.y);
+					chain.push_back(next);
+					extended = true;
+				}
+			}
+		}
+		
+		// Two dots cost the same either way, and plotting lets them share an instruction
+		if(chain.size() >= 3)
+		{
+			for(size_t n = 1; n < chain.size(); n++)
+			{
+				EmitAgiLine(chain[n - 1].x, chain[n - 1].y, chain[n].x, chain[n].y);
+			}
+			continue;
+		}
+		
+		for(Coord& c : chain)
+		{
+			if(c.x == 0)
+				EmitAgiLine(c.x, c.y, c.x, c.y);
+			else
+				plotted.push_back(c);
+		}
+	}
+	
+	// Pending brushes would change the pattern under these plots
+	FlushBrushes();
+	
+	if(plotted.size() == 1 && agiPatternCode != 0)
+	{
+		// Not worth setting the brush for
+		EmitAgiLine(plotted[0].x, plotted[0].y, plotted[0].x, plotted[0].y);
+	}
+	else if(plotted.size() > 0)
+	{
+		if(agiPatternCode != 0)
+		{
+			EmitAgiInstruction(AGI_SET_PATTERN);
+			WriteByte(0);
+			agiPatternCode = 0;
+		}
+		
+		EmitAgiInstruction(AGI_PLOT_INSTRUCTION);
+		for(Coord& c : plotted)
+		{
+			WriteByte((uint8_t) c.x);
+			WriteByte((uint8_t) c.y);
+		}
+	}
+}
+
+void Converter::EmitAgiBrush(uint8_t code, uint8_t texture, int16_t x, int16_t y)
+{
+	FlushFills();
+	
+	AgiBrush brush = { code, texture, x, y };
+	brushes.push_back(brush);
+}
+
+// The brushes all share the current colours, so they can be drawn in any
+// order. Sorted by pattern, each pattern only has to be set once and the
+// brushes using it share one plot instruction.
+void Converter::FlushBrushes()
+{
+	if(brushes.size() == 0)
+		return;
+	
+	vector<AgiBrush> pending;
+	pending.swap(brushes);
+	
+	// Dots are plotted with their own pattern, so get them out of the way first
+	FlushDots();
+	
+	stable_sort(pending.begin(), pending.end(), [this](const AgiBrush& a, const AgiBrush& b)
+	{
+		// Keep whatever pattern is already set first
+		if((a.patternCode == agiPatternCode) != (b.patternCode == agiPatternCode))
+			return a.patternCode == agiPatternCode;
+		return a.patternCode < b.patternCode;
+	});
+	
+	for(size_t n = 0; n < pending.size(); n++)
+	{
+		AgiBrush& brush = pending[n];
+		
+		if(brush.patternCode != agiPatternCode)
+		{
+			EmitAgiInstruction(AGI_SET_PATTERN);
+			WriteByte(brush.patternCode);
+			agiPatternCode = brush.patternCode;
+		}
+		
+		if(n == 0 || pending[n - 1].patternCode != brush.patternCode)
+		{
+			EmitAgiInstruction(AGI_PLOT_INSTRUCTION);
+		}
+		
+		if(brush.patternCode & SCI_PATTERN_CODE_USE_TEXTURE)
+		{
+			WriteByte((uint8_t)(brush.texture << 1));
+		}
+		WriteByte((uint8_t) brush.x);
+		WriteByte((uint8_t) brush.y);
+	}
+}
+
+// Plugs are all different pixels, so they can be drawn in any order. Grouped
+// by colour, each colour only has to be set once, and the group in the fill
+// colours goes last so setting them back is free.
+void SortPlugsByColour(vector<Plug>& plugs, uint8_t fillColour, uint8_t fillPriority)
+{
+	stable_sort(plugs.begin(), plugs.end(), [fillColour, fillPriority](const Plug& a, const Plug& b)
+	{
+		bool aFill = a.visual == fillColour && a.priority == fillPriority;
+		bool bFill = b.visual == fillColour && b.priority == fillPriority;
+		if(aFill != bFill)
+			return bFill;
+		if(a.visual != b.visual)
+			return a.visual < b.visual;
+		return a.priority < b.priority;
+	});
+}
+
+void Converter::EmitAgiPlugs(vector<Plug>& plugs, uint8_t fillColour, uint8_t fillPriority)
+{
+	vector<Plug> sorted(plugs);
+	SortPlugsByColour(sorted, fillColour, fillPriority);
+	
+	for(Plug& plug : sorted)
+	{
+		EmitAgiSetVisual(plug.visual);
+		EmitAgiSetPriority(plug.priority);
+		EmitAgiDot(plug.coord.x, plug.coord.y);
+		agiCanvas.SetPixel(plug.coord.x, plug.coord.y);
+	}
+}
+
+void Converter::DrawLine(int16_t x1, int16_t y1, int16_t x2, int16_t y2)
+{
+	sciCanvas.DrawLine(x1, y1, x2, y2);
+	
+	x1 = SCI_TO_AGI_X(x1);
+	y1 = SCI_TO_AGI_Y(y1);
+	x2 = SCI_TO_AGI_X(x2);
+	y2 = SCI_TO_AGI_Y(y2);
+	
+	// Clip
+	if(y1 < 0 && y2 < 0)
+		return;
+	
+	if(y1 >= 168 && y2 >= 168)
+		return;
+	
+	if(y2 >= 168)
+	{
+		x2 = x1 + ((x2 - x1) * (167 - y1)) / (y2 - y1);
+//		x2 = x1 + ((x2 - x1) * 167) / y2;
+		y2 = 167;
+	}
+	if(y1 >= 168)
+	{
+		x1 = x2 + ((x1 - x2) * (167 - y2)) / (y1 - y2);
 		//x1 = x2 + ((x1 - x2) * 167) / y1;
 		y1 = 167;
 	}
@@ -336,19 +1231,19 @@ void GetRelCoords(int16_t& x, int16_t& y)
 	}
 }
 
-void SetVisualColour()
+void Converter::SetVisualColour(uint8_t colour)
 {
-	uint8_t colour = NextByte();
+	// The pair is looked up when the colour is set, so later palette changes don't affect it
+	uint8_t pair = sciPalettes[colour % (PIC_EGAPALETTE_COUNT * PIC_EGAPALETTE_SIZE)];
+	uint8_t agiColour = ditherToAgiColour[pair];
 	
 	if(verbose)
-		printf("Set visual colour: %d\n", colour);
-	
-	colour &= 0xf;
+		printf("Set visual colour: %d (pair %02x, AGI colour %d)\n", colour, pair, agiColour);
 	
-	EmitAgiSetVisual(colour);
+	EmitAgiSetVisual(agiColour);
 }
 
-void DisableVisual()
+void Converter::DisableVisual()
 {
 	if(verbose)
 		printf("Disable visual\n");
@@ -356,10 +1251,8 @@ void DisableVisual()
 	EmitAgiSetVisual(COLOUR_DISABLED);
 }
 
-void SetPriorityColour()
+void Converter::SetPriorityColour(uint8_t colour)
 {
-	uint8_t colour = NextByte();
-	
 	if(verbose)
 		printf("Set priority colour: %d\n", colour);
 	
@@ -390,7 +1283,7 @@ void SetPriorityColour()
 	EmitAgiSetPriority(agiBand);
 }
 
-void DisablePriority()
+void Converter::DisablePriority()
 {
 	if(verbose)
 		printf("Disable priority\n");
@@ -398,10 +1291,8 @@ void DisablePriority()
 	EmitAgiSetPriority(COLOUR_DISABLED);
 }
 
-void SetControlColour()
+void Converter::SetControlColour(uint8_t colour)
 {
-	uint8_t colour = NextByte();
-	
 	if(verbose)
 		printf("Set control colour: %d\n", colour);
 	
@@ -410,7 +1301,7 @@ void SetControlColour()
 	//WriteByte(colour ? 1 : 0);	
 }
 
-void DisableControl()
+void Converter::DisableControl()
 {
 	if(verbose)
 		printf("Disable control\n");
@@ -419,356 +1310,2880 @@ void DisableControl()
 	//WriteByte(0xf3);
 }
 
-void DrawPattern(int16_t x, int16_t y)
+void Converter::SetPaletteEntry(int entry, uint8_t value)
+{
+	if(verbose)
+		printf("Set palette %d to %x\n", entry, value);
+	
+	sciPalettes[entry % (PIC_EGAPALETTE_COUNT * PIC_EGAPALETTE_SIZE)] = value;
+}
+
+// SCI brushes fill a (size * 2 + 2) x (size * 2 + 1) box with x, y nearer the
+// middle than the corner. The AGI brush of the same size and texture goes over
+// the same box, unless the interpreter would move it to keep it inside the
+// picture or the texture can't be written, in which case its pixels are drawn
+// as dots.
+void Converter::DrawPattern(int16_t x, int16_t y, uint8_t texture)
 {
-	sciCanvas.SetPixel(x, y);
+	uint8_t agiPattern = patternCode & (SCI_PATTERN_CODE_RECTANGLE | SCI_PATTERN_CODE_USE_TEXTURE | SCI_PATTERN_CODE_PENSIZE);
+	int size = agiPattern & SCI_PATTERN_CODE_PENSIZE;
+	const uint8_t* rows = GetBrushStamp(agiPattern, texture);
+	int sciLeft = x - size < 0 ? 0 : x - size;
+	int sciTop = y - size < 0 ? 0 : y - size;
+	int rectangle = (agiPattern & SCI_PATTERN_CODE_RECTANGLE) ? 1 : 0;
+	int textureIndex = (agiPattern & SCI_PATTERN_CODE_USE_TEXTURE) ? texture & 0x7f : BRUSH_NO_TEXTURE;
+	const uint16_t* sciRows = sciBrushStamps[rectangle][size][textureIndex];
+	uint16_t clippedRows[15];
+	
+	if(sciLeft + size * 2 + 2 > SCI_PICTURE_WIDTH)
+	{
+		GetSciBrushRows(rectangle, size, textureIndex, SCI_PICTURE_WIDTH - sciLeft, clippedRows);
+		sciRows = clippedRows;
+	}
 	
-	x = SCI_TO_AGI_X(x);
-	y = SCI_TO_AGI_Y(y);
+	for(int row = 0; row <= size * 2; row++)
+	{
+		sciCanvas.StampRow(sciLeft, sciTop + row, sciRows[row]);
+	}
 	
+	int left = SCI_TO_AGI_X(sciLeft);
+	int top = SCI_TO_AGI_Y(sciTop);
 	
-	if(x >= 0 && y >= 0 && x < AGI_PICTURE_WIDTH && y < AGI_PICTURE_HEIGHT)
+	if(top + size * 2 < 0 || top >= AGI_PICTURE_HEIGHT)
+		return;
+	
+	int agiX = left + (size + 1) / 2;
+	int agiY = top + size;
+	int clampedX = agiX;
+	int clampedY = agiY;
+	ClampAgiBrush(size, clampedX, clampedY);
+	
+	bool textureFits = !(agiPattern & SCI_PATTERN_CODE_USE_TEXTURE) || (texture << 1) < 0xf0;
+	
+	if(size > 0 && textureFits && clampedX == agiX && clampedY == agiY)
+	{
+		DrawAgiBrush(agiCanvas, agiPattern, texture, agiX, agiY, nullptr);
+		EmitAgiBrush(agiPattern, texture, agiX, agiY);
+		return;
+	}
+	
+	for(int row = 0; row <= size * 2; row++)
 	{
-		agiCanvas.SetPixel(x, y);
-		EmitAgiInstruction(AGI_LINE_INSTRUCTION);
-		WriteByte(x);
-		WriteByte(y);
-		WriteByte(x);
-		WriteByte(y);
+		for(int bit = 0; bit <= size; bit++)
+		{
+			int dotX = left + bit;
+			int dotY = top + row;
+			
+			if((rows[row] & (1 << bit)) && dotX < AGI_PICTURE_WIDTH && dotY >= 0 && dotY < AGI_PICTURE_HEIGHT)
+			{
+				agiCanvas.SetPixel(dotX, dotY);
+				EmitAgiDot(dotX, dotY);
+			}
+		}
 	}
 }
 
 
-void GetPatternTexture(int16_t& patternTexture) 
+uint8_t GetPatternTexture(uint8_t patternCode) 
 {
 	if (patternCode & SCI_PATTERN_CODE_USE_TEXTURE) 
 	{
-		patternTexture = (NextByte() >> 1) & 0x7f;
+		return (NextByte() >> 1) & 0x7f;
 	}
+	return 0;
 }
 
-
-void ShortPatterns()
+void DecodePatterns(vector<SciOp>& ops, uint8_t patternCode, void (*getCoords)(int16_t&, int16_t&))
 {
-	int16_t patternTexture;
-	int16_t x, y;
+	SciOp op = {};
+	op.type = SCI_OP_PATTERN;
 	
-	GetPatternTexture(patternTexture);
-	GetAbsCoords(x, y);
-
-	// Draw pattern here
-	//vectorPattern(x, y, pic_color, pic_priority, pic_control, pattern_Code, pattern_Texture);
+	op.value = GetPatternTexture(patternCode);
+	GetAbsCoords(op.x1, op.y1);
+	ops.push_back(op);
 	
 	while(!IsInstruction(PeekByte()))
 	{
-		GetPatternTexture(patternTexture);
-		GetRelCoords(x, y);
-		DrawPattern(x, y);
-		//vectorPattern(x, y, pic_color, pic_priority, pic_control, pattern_Code, pattern_Texture);
+		op.value = GetPatternTexture(patternCode);
+		getCoords(op.x1, op.y1);
+		ops.push_back(op);
 	}
 }
 
-void MediumRelativePatterns()
+void DecodeLines(vector<SciOp>& ops, void (*getCoords)(int16_t&, int16_t&))
 {
-	int16_t patternTexture;
 	int16_t x, y;
 	
-	GetPatternTexture(patternTexture);
 	GetAbsCoords(x, y);
 
-	// Draw pattern here
-	//vectorPattern(x, y, pic_color, pic_priority, pic_control, pattern_Code, pattern_Texture);
-	
 	while(!IsInstruction(PeekByte()))
 	{
-		GetPatternTexture(patternTexture);
-		GetRelCoordsMed(x, y);
-		DrawPattern(x, y);
-		//vectorPattern(x, y, pic_color, pic_priority, pic_control, pattern_Code, pattern_Texture);
+		SciOp op = {};
+		op.type = SCI_OP_LINE;
+		op.x1 = x;
+		op.y1 = y;
+		
+		getCoords(x, y);
+		
+		op.x2 = x;
+		op.y2 = y;
+		ops.push_back(op);
 	}
 }
 
-void LongPatterns()
+int LowestSetBit(uint32_t value)
 {
-	int16_t patternTexture;
-	int16_t x, y;
-	
-	GetPatternTexture(patternTexture);
-	GetAbsCoords(x, y);
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, value);
+	return (int) index;
+#else
+	return __builtin_ctz(value);
+#endif
+}
 
-	// Draw pattern here
-	//vectorPattern(x, y, pic_color, pic_priority, pic_control, pattern_Code, pattern_Texture);
-	
-	while(!IsInstruction(PeekByte()))
+int HighestSetBit(uint32_t value)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse(&index, value);
+	return (int) index;
+#else
+	return 31 - __builtin_clz(value);
+#endif
+}
+
+int CountSetBits(uint64_t value)
+{
+#ifdef _MSC_VER
+	return (int)(__popcnt((uint32_t) value) + __popcnt((uint32_t)(value >> 32)));
+#else
+	return __builtin_popcountll(value);
+#endif
+}
+
+void SetMaskRange(uint32_t* row, int left, int right, bool value)
+{
+	for(int w = left >> 5; w <= right >> 5; w++)
 	{
-		GetPatternTexture(patternTexture);
-		GetAbsCoords(x, y);
-		DrawPattern(x, y);
-		//vectorPattern(x, y, pic_color, pic_priority, pic_control, pattern_Code, pattern_Texture);
+		int first = w == (left >> 5) ? (left & 31) : 0;
+		int last = w == (right >> 5) ? (right & 31) : 31;
+		uint32_t bits = (0xffffffffu >> (31 - last)) & (0xffffffffu << first);
+		
+		row[w] = value ? row[w] | bits : row[w] & ~bits;
 	}
 }
 
-void MediumRelativeLines()
+// Index of the first clear bit at or after x, or the row width
+int FindClearBit(const uint32_t* row, int x, int width)
 {
-	int16_t x, y;
-	int16_t oldx, oldy;
+	int w = x >> 5;
+	uint32_t bits = ~row[w] & (0xffffffffu << (x & 31));
+	int words = (width + 31) / 32;
 	
-	GetAbsCoords(x, y);
+	while(!bits)
+	{
+		if(++w >= words)
+			return width;
+		bits = ~row[w];
+	}
 	
-	//WriteByte(0xf6);
-	//WriteAgiCoords(x, y);
+	int result = w * 32 + LowestSetBit(bits);
+	return result < width ? result : width;
+}
 
-	while(!IsInstruction(PeekByte()))
+// Index of the last clear bit at or before x, or -1
+int FindClearBitBefore(const uint32_t* row, int x)
+{
+	int w = x >> 5;
+	uint32_t bits = ~row[w] & (0xffffffffu >> (31 - (x & 31)));
+	
+	while(!bits)
 	{
-		oldx = x;
-		oldy = y;
-		
-		GetRelCoordsMed(x, y);
-		
-		//WriteAgiCoords(x, y);
-		
-		if(verbose)
-			printf("Line %d, %d - %d, %d\n", oldx, oldy, x, y);
-		
-		DrawLine(oldx, oldy, x, y);
+		if(--w < 0)
+			return -1;
+		bits = ~row[w];
 	}
+	
+	return w * 32 + HighestSetBit(bits);
 }
 
-void LongLines()
+// Index of the first set bit in x..last, or -1
+int FindSetBit(const uint32_t* row, int x, int last)
 {
-	int16_t x, y;
-	int16_t oldx, oldy;
+	int w = x >> 5;
+	uint32_t bits = row[w] & (0xffffffffu << (x & 31));
 	
-	GetAbsCoords(x, y);
+	while(!bits)
+	{
+		if(++w > (last >> 5))
+			return -1;
+		bits = row[w];
+	}
+	
+	int result = w * 32 + LowestSetBit(bits);
+	return result <= last ? result : -1;
+}
 
-	//WriteByte(0xf6);
-	//WriteAgiCoords(x, y);
+void FillMask::Set(int x, int y)
+{
+	if(x >= 0 && y >= 0 && x < AGI_PICTURE_WIDTH && y < AGI_PICTURE_HEIGHT)
+	{
+		rows[y][x >> 5] |= 1u << (x & 31);
+	}
+}
 
-	while(!IsInstruction(PeekByte()))
+void FillMask::Reset(int x, int y)
+{
+	if(x >= 0 && y >= 0 && x < AGI_PICTURE_WIDTH && y < AGI_PICTURE_HEIGHT)
 	{
-		oldx = x;
-		oldy = y;
-		
-		GetAbsCoords(x, y);
-		
-		//WriteAgiCoords(x, y);
+		rows[y][x >> 5] &= ~(1u << (x & 31));
+	}
+}
 
-		if(verbose)
-			printf("Line %d, %d - %d, %d\n", oldx, oldy, x, y);
-		
-		DrawLine(oldx, oldy, x, y);
+bool FillMask::Test(int x, int y)
+{
+	if(x >= 0 && y >= 0 && x < AGI_PICTURE_WIDTH && y < AGI_PICTURE_HEIGHT)
+	{
+		return (rows[y][x >> 5] & (1u << (x & 31))) != 0;
 	}
+	return false;
 }
 
-void ShortRelativeLines()
+// Downsample the SCI fill result into AGI pixel space
+void Converter::ProjectSciFill(vector<Coord>& sciFilled, FillMask& sciMask)
 {
-	int16_t x, y;
-	int16_t oldx, oldy;
+	sciMask.Clear();
 	
-	GetAbsCoords(x, y);
-	
-	//WriteByte(0xf6);
-	//WriteAgiCoords(x, y);
-	
-	while(!IsInstruction(PeekByte()))
+	for(Coord& s : sciFilled)
 	{
-		oldx = x;
-		oldy = y;
-		
-		GetRelCoords(x, y);
-		
-		//WriteAgiCoords(x, y);
-
-		if(verbose)
-			printf("Line %d, %d - %d, %d\n", oldx, oldy, x, y);
-		
-		DrawLine(oldx, oldy, x, y);
+		sciMask.Set(SCI_TO_AGI_X(s.x), SCI_TO_AGI_Y(s.y));
 	}
 }
 
-bool CheckFilledCorrectly(vector<Coord>& agiFilled, vector<Coord>& sciFilled, Coord& failedCoord)
+// Collects every AGI filled pixel that lies outside the SCI fill, in scanline order
+bool CheckFilledCorrectly(vector<Coord>& agiFilled, FillMask& sciMask, FillMask& agiMask, vector<Coord>& failedCoords)
 {
+	agiMask.Clear();
+	
 	for(Coord& a : agiFilled)
 	{
-		bool hasMatch = false;
-		
-		for(Coord& s : sciFilled)
+		agiMask.Set(a.x, a.y);
+	}
+	
+	failedCoords.clear();
+	
+	for(int y = 0; y < AGI_PICTURE_HEIGHT; y++)
+	{
+		for(int w = 0; w < FILL_MASK_WORDS; w++)
 		{
-			if(SCI_TO_AGI_X(s.x) == a.x && SCI_TO_AGI_Y(s.y) == a.y)
+			uint32_t leaked = agiMask.rows[y][w] & ~sciMask.rows[y][w];
+			
+			while(leaked)
 			{
-				hasMatch = true;
-				break;
+				failedCoords.push_back(Coord(w * 32 + LowestSetBit(leaked), y));
+				leaked &= leaked - 1;
 			}
 		}
-		
-		if(!hasMatch)
-		{
-			failedCoord = a;
-			return false;
-		}
 	}
 	
-	return true;
+	return failedCoords.size() == 0;
 }	
 
-void TryFill(vector<Coord>& sciFilled, int16_t x, int16_t y)
+// Walks the region an AGI fill from the seed would cover, without crossing
+// the SCI fill region. Every fillable pixel just outside it is a leak.
+// Pixels are marked in visited, which labels the region for DoFill.
+void Converter::FindLeaks(FillMask& sciMask, FillMask& visited, int agiX, int agiY, vector<Coord>& leaks, vector<Coord>& region)
 {
-	uint8_t fillColour = penColour;
-	uint8_t fillPriority = priorityColour;
-	vector<Coord> agiFilled;
-
-	while(1)
+	vector<Coord> stack;
+	
+	leaks.clear();
+	region.clear();
+	
+	if(!agiCanvas.FillHasEffect())
+		return;
+	
+	stack.push_back(Coord(agiX, agiY));
+	
+	while(stack.size() > 0)
 	{
-		agiCanvas.Fill(SCI_TO_AGI_X(x), SCI_TO_AGI_Y(y), &agiFilled);
+		Coord c = stack.back();
+		stack.pop_back();
 		
-		Coord errorCoord;
-		if(CheckFilledCorrectly(agiFilled, sciFilled, errorCoord))
-		{
-			break;
-		}
-
-		agiCanvas.UndoFill();
+		if(c.x < 0 || c.y < 0 || c.x >= AGI_PICTURE_WIDTH || c.y >= AGI_PICTURE_HEIGHT)
+			continue;
+		if(visited.Test(c.x, c.y) || !agiCanvas.OkToFill(c.x, c.y))
+			continue;
 		
-		uint8_t visualGap = fillColour;
-		uint8_t priorityGap = fillPriority;
+		visited.Set(c.x, c.y);
 		
-		if(visualGap != COLOUR_DISABLED)
-		{
-			visualGap = sciCanvas.GetVisualPixel(AGI_TO_SCI_X(errorCoord.x), AGI_TO_SCI_Y(errorCoord.y));
-			if(visualGap == sciCanvas.blankVisual)
-			{
-				visualGap = sciCanvas.GetVisualPixel(AGI_TO_SCI_X(errorCoord.x) + 1, AGI_TO_SCI_Y(errorCoord.y));
-			}
-			if(visualGap == sciCanvas.blankVisual)
-			{
-				visualGap = 0;
-			}
-		}
-		if(priorityGap != COLOUR_DISABLED)
+		if(!sciMask.Test(c.x, c.y))
 		{
-			priorityGap = sciCanvas.GetPriorityPixel(AGI_TO_SCI_X(errorCoord.x), AGI_TO_SCI_Y(errorCoord.y));
-			if(priorityGap == sciCanvas.blankPriority)
-			{
-				priorityGap = sciCanvas.GetPriorityPixel(AGI_TO_SCI_X(errorCoord.x) + 1, AGI_TO_SCI_Y(errorCoord.y));
-			}
-			if(priorityGap == sciCanvas.blankPriority)
-			{
-				priorityGap = 0;
-			}
+			leaks.push_back(c);
+			continue;
 		}
 		
-		EmitAgiPixel(errorCoord.x, errorCoord.y, visualGap, priorityGap);
+		region.push_back(c);
+		pixelsVisited++;
 		
-		agiCanvas.SetPixel(errorCoord.x, errorCoord.y);
-		EmitAgiSetVisual(fillColour);
-		EmitAgiSetPriority(fillPriority);
+		stack.push_back(Coord(c.x - 1, c.y));
+		stack.push_back(Coord(c.x + 1, c.y));
+		stack.push_back(Coord(c.x, c.y - 1));
+		stack.push_back(Coord(c.x, c.y + 1));
 	}
-	
-	//EmitAgiSetVisual(fillColour);
-	//EmitAgiSetPriority(fillPriority);
-	EmitAgiFill(SCI_TO_AGI_X(x), SCI_TO_AGI_Y(y));
 }
 
-void DoFill(int16_t x, int16_t y)
-{		
-	vector<Coord> sciFilled;
-
-	sciCanvas.Fill(x, y, &sciFilled);
-	
-	// Find and fill gaps
-	TryFill(sciFilled, x, y);
+// Plugs take the colour of the SCI line that should have stopped the fill
+void Converter::GetGapColours(Coord& coord, uint8_t fillColour, uint8_t fillPriority, uint8_t& visualGap, uint8_t& priorityGap)
+{
+	visualGap = fillColour;
+	priorityGap = fillPriority;
 	
-	// Check everywhere is filled correctly
-	for(Coord& c : sciFilled)
+	if(visualGap != COLOUR_DISABLED)
 	{
-		if(agiCanvas.OkToFill(SCI_TO_AGI_X(c.x), SCI_TO_AGI_Y(c.y)))
+		visualGap = sciCanvas.GetVisualPixel(AGI_TO_SCI_X(coord.x), AGI_TO_SCI_Y(coord.y));
+		if(visualGap == sciCanvas.blankVisual)
+		{
+			visualGap = sciCanvas.GetVisualPixel(AGI_TO_SCI_X(coord.x) + 1, AGI_TO_SCI_Y(coord.y));
+		}
+		if(visualGap == sciCanvas.blankVisual)
 		{
-			TryFill(sciFilled, c.x, c.y);
+			visualGap = 0;
 		}
 	}
-}
-
-void FloodFill()
-{
-	int16_t x, y;
-			
-	while(!IsInstruction(PeekByte()))
+	if(priorityGap != COLOUR_DISABLED)
 	{
-		GetAbsCoords(x, y);
-		
-		DoFill(x, y);
-
-		if(verbose)
-			printf("Fill %d, %d\n", x, y);
+		priorityGap = sciCanvas.GetPriorityPixel(AGI_TO_SCI_X(coord.x), AGI_TO_SCI_Y(coord.y));
+		if(priorityGap == sciCanvas.blankPriority)
+		{
+			priorityGap = sciCanvas.GetPriorityPixel(AGI_TO_SCI_X(coord.x) + 1, AGI_TO_SCI_Y(coord.y));
+		}
+		if(priorityGap == sciCanvas.blankPriority)
+		{
+			priorityGap = 0;
+		}
 	}
 }
 
-void SetPattern()
+void Converter::GreedyPlugs(vector<Coord>& leaks, uint8_t fillColour, uint8_t fillPriority, vector<Plug>& plugs)
 {
-	patternCode = NextByte();
+	plugs.clear();
 	
-	if(verbose)
-		printf("Set pattern: %d\n", patternCode);
+	for(Coord& leak : leaks)
+	{
+		Plug plug;
+		plug.coord = leak;
+		GetGapColours(leak, fillColour, fillPriority, plug.visual, plug.priority);
+		plugs.push_back(plug);
+	}
 }
 
-void CommandExtensions()
+// Bytes EmitAgiPlugs spends on a set of plugs, including restoring the fill
+// colours, if every colour group is plotted. Runs of neighbouring plugs can
+// come out smaller.
+int EstimatePlugBytes(vector<Plug>& plugs, uint8_t fillColour, uint8_t fillPriority)
 {
-	uint8_t commandNumber = NextByte();
+	vector<Plug> sorted(plugs);
+	SortPlugsByColour(sorted, fillColour, fillPriority);
 	
-	switch(commandNumber)
+	uint8_t visual = fillColour;
+	uint8_t priority = fillPriority;
+	int bytes = 0;
+	
+	for(size_t n = 0; n < sorted.size(); n++)
 	{
-		case 0:		// Set palette entry
-		while(!IsInstruction(PeekByte()))
+		Plug& plug = sorted[n];
+		bool newGroup = n == 0;
+		
+		if(plug.visual != visual)
 		{
-			uint8_t pixel = NextByte();
+			bytes += plug.visual == COLOUR_DISABLED ? 1 : 2;
+			visual = plug.visual;
+			newGroup = true;
+		}
+		if(plug.priority != priority)
+		{
+			bytes += plug.priority == COLOUR_DISABLED ? 1 : 2;
+			priority = plug.priority;
+			newGroup = true;
+		}
+		if(newGroup)
+		{
+			bytes++;
+		}
+		bytes += 2;
+	}
+	
+	if(visual != fillColour)
+	{
+		bytes += fillColour == COLOUR_DISABLED ? 1 : 2;
+	}
+	if(priority != fillPriority)
+	{
+		bytes += fillPriority == COLOUR_DISABLED ? 1 : 2;
+	}
+	
+	return bytes;
+}
+
+// Every leak touches the fill region, so either the leak or the region pixel
+// next to it must be plugged. Region pixels can be plugged with the fill
+// colours without changing the picture, so the smallest plug set is a minimum
+// vertex cover of the region/leak adjacency graph. It is bipartite, so the
+// cover comes from a maximum matching (Konig's theorem).
+// Returns false if the cover is no better than plugging every leak, or if
+// plugging region pixels would split the region. Otherwise seed is moved to a
+// pixel that is still fillable, or set to -1 if the plugs cover the region.
+bool Converter::SolveMinimalPlugs(vector<Coord>& region, vector<Coord>& leaks, Coord& seed, uint8_t fillColour, uint8_t fillPriority, vector<Plug>& plugs)
+{
+	if(leaks.size() == 0)
+		return false;
+	
+	vector<int> leakIndex(AGI_PICTURE_WIDTH * AGI_PICTURE_HEIGHT, -1);
+	for(int n = 0; n < (int) leaks.size(); n++)
+	{
+		leakIndex[leaks[n].y * AGI_PICTURE_WIDTH + leaks[n].x] = n;
+	}
+	
+	// Region pixels that touch a leak, with up to four leak neighbours each
+	vector<Coord> edge;
+	vector<int> edgeLinks;
+	static const int offsets[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+	
+	for(Coord& c : region)
+	{
+		int links[4];
+		int count = 0;
+		
+		for(int d = 0; d < 4; d++)
+		{
+			int i = c.x + offsets[d][0];
+			int j = c.y + offsets[d][1];
+			
+			if(i >= 0 && j >= 0 && i < AGI_PICTURE_WIDTH && j < AGI_PICTURE_HEIGHT && leakIndex[j * AGI_PICTURE_WIDTH + i] >= 0)
+			{
+				links[count++] = leakIndex[j * AGI_PICTURE_WIDTH + i];
+			}
+		}
+		
+		if(count > 0)
+		{
+			edge.push_back(c);
+			for(int d = 0; d < 4; d++)
+			{
+				edgeLinks.push_back(d < count ? links[d] : -1);
+			}
+		}
+	}
+	
+	// Maximum matching by breadth first augmenting paths
+	vector<int> edgeMatch(edge.size(), -1);
+	vector<int> leakMatch(leaks.size(), -1);
+	vector<int> parent(edge.size());
+	vector<int> queue;
+	int matched = 0;
+	
+	for(int root = 0; root < (int) edge.size(); root++)
+	{
+		fill(parent.begin(), parent.end(), -2);
+		queue.clear();
+		queue.push_back(root);
+		parent[root] = -1;
+		
+		int freeLeak = -1;
+		int freeLeakFrom = -1;
+		
+		for(int head = 0; head < (int) queue.size() && freeLeak < 0; head++)
+		{
+			int u = queue[head];
+			pixelsVisited++;
+			
+			for(int d = 0; d < 4; d++)
+			{
+				int v = edgeLinks[u * 4 + d];
+				if(v < 0)
+					break;
+				
+				if(leakMatch[v] < 0)
+				{
+					freeLeak = v;
+					freeLeakFrom = u;
+					break;
+				}
+				if(parent[leakMatch[v]] == -2)
+				{
+					parent[leakMatch[v]] = u;
+					queue.push_back(leakMatch[v]);
+				}
+			}
+		}
+		
+		// Matching can take a lot longer than finding the leaks did, so give up
+		// on it as soon as the budget runs out and keep the greedy plugs
+		if(workBudget > 0 && pixelsVisited > workBudget)
+			return false;
+		
+		if(freeLeak < 0)
+			continue;
+		
+		// Flip the path back to the root
+		int u = freeLeakFrom;
+		int v = freeLeak;
+		while(u >= 0)
+		{
+			int previous = edgeMatch[u];
+			edgeMatch[u] = v;
+			leakMatch[v] = u;
+			v = previous;
+			u = parent[u];
+		}
+		matched++;
+	}
+	
+	if(matched >= (int) leaks.size())
+		return false;
+	
+	// Konig: walk alternating paths from the unmatched region pixels. The cover
+	// is the region pixels not reached plus the leaks that were reached.
+	vector<bool> edgeReached(edge.size(), false);
+	vector<bool> leakReached(leaks.size(), false);
+	queue.clear();
+	
+	for(int u = 0; u < (int) edge.size(); u++)
+	{
+		if(edgeMatch[u] < 0)
+		{
+			edgeReached[u] = true;
+			queue.push_back(u);
+		}
+	}
+	
+	for(int head = 0; head < (int) queue.size(); head++)
+	{
+		int u = queue[head];
+		
+		for(int d = 0; d < 4; d++)
+		{
+			int v = edgeLinks[u * 4 + d];
+			if(v < 0)
+				break;
+			
+			if(!leakReached[v])
+			{
+				leakReached[v] = true;
+				if(leakMatch[v] >= 0 && !edgeReached[leakMatch[v]])
+				{
+					edgeReached[leakMatch[v]] = true;
+					queue.push_back(leakMatch[v]);
+				}
+			}
+		}
+	}
+	
+	FillMask blocked;
+	int blockedCount = 0;
+	
+	for(int u = 0; u < (int) edge.size(); u++)
+	{
+		if(!edgeReached[u])
+		{
+			blocked.Set(edge[u].x, edge[u].y);
+			blockedCount++;
+		}
+	}
+	
+	// The fill must still reach every region pixel that is not plugged. The
+	// seed may be plugged itself, in which case the fill moves to another pixel
+	// or is not needed at all.
+	FillMask inRegion;
+	for(Coord& c : region)
+	{
+		inRegion.Set(c.x, c.y);
+	}
+	
+	seed = Coord(-1, -1);
+	for(Coord& c : region)
+	{
+		if(!blocked.Test(c.x, c.y))
+		{
+			seed = c;
+			break;
+		}
+	}
+	
+	if(seed.x >= 0)
+	{
+		vector<Coord> stack;
+		int reached = 0;
+		stack.push_back(seed);
+		blocked.Set(seed.x, seed.y);
+		
+		while(stack.size() > 0)
+		{
+			Coord c = stack.back();
+			stack.pop_back();
+			reached++;
+			
+			for(int d = 0; d < 4; d++)
+			{
+				int i = c.x + offsets[d][0];
+				int j = c.y + offsets[d][1];
+				
+				if(inRegion.Test(i, j) && !blocked.Test(i, j))
+				{
+					blocked.Set(i, j);
+					stack.push_back(Coord(i, j));
+				}
+			}
+		}
+		
+		if(reached != (int) region.size() - blockedCount)
+			return false;
+	}
+	
+	plugs.clear();
+	
+	for(int u = 0; u < (int) edge.size(); u++)
+	{
+		if(!edgeReached[u])
+		{
+			Plug plug;
+			plug.coord = edge[u];
+			plug.visual = fillColour;
+			plug.priority = fillPriority;
+			plugs.push_back(plug);
+		}
+	}
+	for(int v = 0; v < (int) leaks.size(); v++)
+	{
+		if(leakReached[v])
+		{
+			Plug plug;
+			plug.coord = leaks[v];
+			GetGapColours(leaks[v], fillColour, fillPriority, plug.visual, plug.priority);
+			plugs.push_back(plug);
+		}
+	}
+	
+	return true;
+}
+
+void Converter::TryFill(FillMask& sciMask, FillMask& visited, int16_t x, int16_t y)
+{
+	uint8_t fillColour = penColour;
+	uint8_t fillPriority = priorityColour;
+	vector<Coord> leaks;
+	vector<Coord> region;
+	vector<Plug> plugs;
+	Coord seed(x, y);
+	
+	fillCount++;
+	
+	if(fastMode || (workBudget > 0 && pixelsVisited > workBudget))
+	{
+		// Fill as the SCI picture does and let it leak
+		unsealedFills++;
+		EmitAgiSetVisual(fillColour);
+		EmitAgiSetPriority(fillPriority);
+		
+		vector<Coord> agiFilled;
+		agiCanvas.Fill(seed.x, seed.y, &agiFilled);
+		if(agiFilled.size() > 0)
+			EmitAgiFill(seed.x, seed.y);
+		return;
+	}
+	
+	// Seal every leak up front so the AGI fill only needs to run once
+	FindLeaks(sciMask, visited, x, y, leaks, region);
+	GreedyPlugs(leaks, fillColour, fillPriority, plugs);
+	
+	if(minimalPlugs)
+	{
+		vector<Plug> minimal;
+		
+		if(SolveMinimalPlugs(region, leaks, seed, fillColour, fillPriority, minimal))
+		{
+			plugBytesSaved += EstimatePlugBytes(plugs, fillColour, fillPriority) - EstimatePlugBytes(minimal, fillColour, fillPriority);
+			plugs.swap(minimal);
+			
+			if(seed.x < 0)
+			{
+				// Saved the fill instruction too
+				plugBytesSaved += 3;
+			}
+		}
+	}
+	
+	EmitAgiPlugs(plugs, fillColour, fillPriority);
+	plugCount += (int) plugs.size();
+	
+	EmitAgiSetVisual(fillColour);
+	EmitAgiSetPriority(fillPriority);
+	
+	if(seed.x < 0)
+		return;
+	
+	vector<Coord> agiFilled;
+	vector<Coord> failedCoords;
+	FillMask agiMask;
+	
+	agiCanvas.Fill(seed.x, seed.y, &agiFilled);
+	
+	// A seed in an area that is already filled would only cost bytes
+	if(agiFilled.size() == 0)
+		return;
+	
+	if(!CheckFilledCorrectly(agiFilled, sciMask, agiMask, failedCoords))
+	{
+		printf("Warning: fill at %d, %d leaked %d pixels\n", seed.x, seed.y, (int) failedCoords.size());
+	}
+	
+	EmitAgiFill(seed.x, seed.y);
+}
+
+void Converter::DoFill(int16_t x, int16_t y)
+{		
+	vector<Coord> sciFilled;
+	FillMask sciMask;
+	FillMask visited;
+
+	sciCanvas.Fill(x, y, &sciFilled);
+	ProjectSciFill(sciFilled, sciMask);
+	
+	// Find and fill gaps
+	TryFill(sciMask, visited, SCI_TO_AGI_X(x), SCI_TO_AGI_Y(y));
+	
+	// Without sealing nothing was visited, and parts the fill could not reach are left
+	if(fastMode || (workBudget > 0 && pixelsVisited > workBudget))
+		return;
+	
+	if(!agiCanvas.FillHasEffect())
+		return;
+	
+	// Whatever part of the SCI region is still unvisited was cut off from the
+	// first fill. Each TryFill labels a whole component in visited, so one
+	// sweep over the mask seeds every remaining component exactly once.
+	for(int j = 0; j < AGI_PICTURE_HEIGHT; j++)
+	{
+		for(int w = 0; w < FILL_MASK_WORDS; w++)
+		{
+			uint32_t unvisited = sciMask.rows[j][w] & ~visited.rows[j][w];
+			
+			while(unvisited)
+			{
+				int i = w * 32 + LowestSetBit(unvisited);
+				unvisited &= unvisited - 1;
+				
+				if(!visited.Test(i, j) && agiCanvas.OkToFill(i, j))
+				{
+					TryFill(sciMask, visited, i, j);
+				}
+			}
+		}
+	}
+}
+
+void DecodeFills(vector<SciOp>& ops)
+{
+	while(!IsInstruction(PeekByte()))
+	{
+		SciOp op = {};
+		op.type = SCI_OP_FILL;
+		GetAbsCoords(op.x1, op.y1);
+		ops.push_back(op);
+	}
+}
+
+void DecodePaletteEntry(vector<SciOp>& ops, int entry, uint8_t value)
+{
+	SciOp op = {};
+	op.type = SCI_OP_SET_PALETTE_ENTRY;
+	op.x1 = entry;
+	op.value = value;
+	ops.push_back(op);
+}
+
+void DecodeCommandExtensions(vector<SciOp>& ops)
+{
+	uint8_t commandNumber = NextByte();
+
+	switch(commandNumber)
+	{
+		case 0:		// Set palette entry
+		while(!IsInstruction(PeekByte()))
+		{
+			uint8_t pixel = NextByte();
 			uint8_t value = NextByte();
-			if(verbose)
-				printf("Set palette %d to %x\n", pixel, value);
+			DecodePaletteEntry(ops, pixel, value);
+		}
+		break;
+
+		case 1:		// Set whole palette
+		{
+			uint8_t pixel = NextByte();
+			for(int c = 0; c < PIC_EGAPALETTE_SIZE; c++)
+			{
+				DecodePaletteEntry(ops, pixel * PIC_EGAPALETTE_SIZE + c, NextByte());
+			}
+		}
+		break;
+
+		case 2:		// Set monochrome palette
+		{
+			pictureDataPtr += 41;
+		}
+		break;
+
+		case 3:
+		case 4:
+		{
+			NextByte();
+		}
+		break;
+
+		case 5:
+		case 6:
+		{
+
 		}
 		break;
+
+		default:
+		printf("Uknown command extension: %x\n", commandNumber);
+		exit(1);
+		break;
+	}
+}
+
+// Decodes the whole SCI byte stream up front so that drawing and emitting
+// run from the op list
+bool DecodePicture(vector<SciOp>& ops)
+{
+	pictureDataPtr = pictureData;
+
+	if(NextWord() != 0x0081)
+	{
+		printf("Incorrect header: not a SCI picture resource?\n");
+		return false;
+	}
+
+	uint8_t patternCode = 0;
+	bool parsing = true;
+
+	while(parsing && pictureDataPtr < pictureData + pictureDataLength)
+	{
+		uint8_t instruction = NextByte();
+		SciOp op = {};
+
+		switch((int)instruction)
+		{
+			case 0xf0:
+			op.type = SCI_OP_SET_VISUAL;
+			op.value = NextByte();
+			ops.push_back(op);
+			break;
+			case 0xf1:
+			op.type = SCI_OP_DISABLE_VISUAL;
+			ops.push_back(op);
+			break;
+			case 0xf2:
+			op.type = SCI_OP_SET_PRIORITY;
+			op.value = NextByte();
+			ops.push_back(op);
+			break;
+			case 0xf3:
+			op.type = SCI_OP_DISABLE_PRIORITY;
+			ops.push_back(op);
+			break;
+			case 0xf4:
+			DecodePatterns(ops, patternCode, GetRelCoords);
+			break;
+			case 0xf5:
+			DecodeLines(ops, GetRelCoordsMed);
+			break;
+			case 0xf6:
+			DecodeLines(ops, GetAbsCoords);
+			break;
+			case 0xf7:
+			DecodeLines(ops, GetRelCoords);
+			break;
+			case 0xf8:
+			DecodeFills(ops);
+			break;
+			case 0xf9:
+			patternCode = NextByte();
+			op.type = SCI_OP_SET_PATTERN;
+			op.value = patternCode;
+			ops.push_back(op);
+			break;
+			case 0xfa:
+			DecodePatterns(ops, patternCode, GetAbsCoords);
+			break;
+			case 0xfb:
+			op.type = SCI_OP_SET_CONTROL;
+			op.value = NextByte();
+			ops.push_back(op);
+			break;
+			case 0xfc:
+			op.type = SCI_OP_DISABLE_CONTROL;
+			ops.push_back(op);
+			break;
+			case 0xfd:
+			DecodePatterns(ops, patternCode, GetRelCoordsMed);
+			break;
+			case 0xfe:
+			DecodeCommandExtensions(ops);
+			break;
+			case 0xff:
+			parsing = false;
+			break;
+
+			default:
+			printf("Unknown instruction! %x\n", instruction);
+			//parsing = false;
+			break;
+		}
+	}
+
+	return true;
+}
+
+void Converter::ExecuteSciOp(SciOp& op)
+{
+	switch(op.type)
+	{
+		case SCI_OP_SET_VISUAL:
+		SetVisualColour(op.value);
+		break;
+		case SCI_OP_DISABLE_VISUAL:
+		DisableVisual();
+		break;
+		case SCI_OP_SET_PRIORITY:
+		SetPriorityColour(op.value);
+		break;
+		case SCI_OP_DISABLE_PRIORITY:
+		DisablePriority();
+		break;
+		case SCI_OP_SET_CONTROL:
+		SetControlColour(op.value);
+		break;
+		case SCI_OP_DISABLE_CONTROL:
+		DisableControl();
+		break;
+		case SCI_OP_SET_PATTERN:
+		patternCode = op.value;
+		if(verbose)
+			printf("Set pattern: %d\n", patternCode);
+		break;
+		case SCI_OP_LINE:
+		if(verbose)
+			printf("Line %d, %d - %d, %d\n", op.x1, op.y1, op.x2, op.y2);
+		DrawLine(op.x1, op.y1, op.x2, op.y2);
+		break;
+		case SCI_OP_PATTERN:
+		DrawPattern(op.x1, op.y1, op.value);
+		break;
+		case SCI_OP_FILL:
+		DoFill(op.x1, op.y1);
+		if(verbose)
+			printf("Fill %d, %d\n", op.x1, op.y1);
+		break;
+		case SCI_OP_SET_PALETTE_ENTRY:
+		SetPaletteEntry(op.x1, op.value);
+		break;
+	}
+}
+
+// Horizontal, vertical and 45 degree lines draw exactly the pixels between
+// their ends whichever way they are drawn, so runs on the same line that
+// overlap or touch can be joined and drawn in either direction.
+// type 0: horizontal, intercept is y. type 1: vertical, intercept is x.
+// type 2: y - x is the intercept. type 3: y + x is the intercept.
+// lo and hi are the x range, or the y range for vertical runs.
+struct ControlRun
+{
+	int type;
+	int intercept;
+	int lo, hi;
+};
+
+struct ControlSegment
+{
+	Coord start, end;
+	bool reversible;
+};
+
+bool GetControlRun(ControlLine& line, ControlRun& run)
+{
+	int dx = line.end.x - line.start.x;
+	int dy = line.end.y - line.start.y;
+	
+	if(dy == 0)
+	{
+		run.type = 0;
+		run.intercept = line.start.y;
+		run.lo = min(line.start.x, line.end.x);
+		run.hi = max(line.start.x, line.end.x);
+	}
+	else if(dx == 0)
+	{
+		run.type = 1;
+		run.intercept = line.start.x;
+		run.lo = min(line.start.y, line.end.y);
+		run.hi = max(line.start.y, line.end.y);
+	}
+	else if(dx == dy || dx == -dy)
+	{
+		run.type = dx == dy ? 2 : 3;
+		run.intercept = dx == dy ? line.start.y - line.start.x : line.start.y + line.start.x;
+		run.lo = min(line.start.x, line.end.x);
+		run.hi = max(line.start.x, line.end.x);
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+Coord GetControlRunPoint(ControlRun& run, int position)
+{
+	switch(run.type)
+	{
+		case 0:
+		return Coord(position, run.intercept);
+		case 1:
+		return Coord(run.intercept, position);
+		case 2:
+		return Coord(position, run.intercept + position);
+		default:
+		return Coord(position, run.intercept - position);
+	}
+}
+
+// Joins runs that overlap or touch, drops repeated lines and returns what is
+// left as segments that draw the same pixels
+void MergeControlLines(vector<ControlLine>& lines, vector<ControlSegment>& segments)
+{
+	vector<ControlRun> runs;
+	vector<ControlLine> others;
+	
+	segments.clear();
+	
+	for(ControlLine& line : lines)
+	{
+		ControlRun run;
+		if(GetControlRun(line, run))
+			runs.push_back(run);
+		else
+			others.push_back(line);
+	}
+	
+	sort(runs.begin(), runs.end(), [](const ControlRun& a, const ControlRun& b)
+	{
+		if(a.type != b.type)
+			return a.type < b.type;
+		if(a.intercept != b.intercept)
+			return a.intercept < b.intercept;
+		return a.lo < b.lo;
+	});
+	
+	for(size_t n = 0; n < runs.size(); )
+	{
+		ControlRun merged = runs[n];
+		
+		for(n++; n < runs.size() && runs[n].type == merged.type && runs[n].intercept == merged.intercept && runs[n].lo <= merged.hi + 1; n++)
+		{
+			merged.hi = max(merged.hi, runs[n].hi);
+		}
+		
+		ControlSegment segment;
+		segment.start = GetControlRunPoint(merged, merged.lo);
+		segment.end = GetControlRunPoint(merged, merged.hi);
+		segment.reversible = true;
+		segments.push_back(segment);
+	}
+	
+	// Other lines can round differently when drawn backwards, so only exact repeats go
+	sort(others.begin(), others.end(), [](const ControlLine& a, const ControlLine& b)
+	{
+		if(a.start.x != b.start.x)
+			return a.start.x < b.start.x;
+		if(a.start.y != b.start.y)
+			return a.start.y < b.start.y;
+		if(a.end.x != b.end.x)
+			return a.end.x < b.end.x;
+		return a.end.y < b.end.y;
+	});
+	
+	for(size_t n = 0; n < others.size(); n++)
+	{
+		if(n > 0 && others[n].start.x == others[n - 1].start.x && others[n].start.y == others[n - 1].start.y
+			&& others[n].end.x == others[n - 1].end.x && others[n].end.y == others[n - 1].end.y)
+			continue;
+		
+		ControlSegment segment;
+		segment.start = others[n].start;
+		segment.end = others[n].end;
+		segment.reversible = false;
+		segments.push_back(segment);
+	}
+}
+
+// The segments of a control line class listed under each point they end at,
+// with counts of the unused ones per point, so starting and continuing chains
+// never has to look through every segment. Entries for a point are together
+// and in segment order.
+struct ControlSegmentIndex
+{
+	ControlSegmentIndex(vector<ControlSegment>& inSegments);
+	
+	int FindPoint(Coord& point);
+	void Use(size_t n);
+	int CountAt(size_t skip, Coord& point, bool& leadsIn);
+	bool UseNextFrom(Coord point, ControlSegment& segment);
+	
+	struct Entry
+	{
+		uint32_t key;
+		uint32_t segment;
+	};
+	
+	static uint32_t PointKey(Coord& point) { return ((uint32_t) point.y << 16) | (uint16_t) point.x; }
+	
+	vector<ControlSegment>& segments;
+	vector<bool> used;
+	size_t firstUnused;
+	
+	vector<Entry> entries;
+	
+	// Per point, sorted by key. firstEntry has one more at the end.
+	vector<uint32_t> pointKeys;
+	vector<int> firstEntry;
+	vector<int> unusedCount;
+	vector<int> leadsInCount;
+	
+	// Per segment
+	vector<int> startPoint;
+	vector<int> endPoint;
+};
+
+ControlSegmentIndex::ControlSegmentIndex(vector<ControlSegment>& inSegments) :
+	segments(inSegments), used(inSegments.size(), false), firstUnused(0),
+	startPoint(inSegments.size()), endPoint(inSegments.size())
+{
+	for(size_t n = 0; n < segments.size(); n++)
+	{
+		Entry entry = { PointKey(segments[n].start), (uint32_t) n };
+		entries.push_back(entry);
+		
+		// A segment that starts and ends on the same point is only listed there once
+		if(PointKey(segments[n].end) != entry.key)
+		{
+			entry.key = PointKey(segments[n].end);
+			entries.push_back(entry);
+		}
+	}
+	
+	sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b)
+	{
+		if(a.key != b.key)
+			return a.key < b.key;
+		return a.segment < b.segment;
+	});
+	
+	for(size_t n = 0; n < entries.size(); n++)
+	{
+		if(n == 0 || entries[n].key != entries[n - 1].key)
+		{
+			pointKeys.push_back(entries[n].key);
+			firstEntry.push_back((int) n);
+			unusedCount.push_back(0);
+			leadsInCount.push_back(0);
+		}
+		unusedCount.back()++;
+	}
+	firstEntry.push_back((int) entries.size());
+	
+	for(size_t n = 0; n < segments.size(); n++)
+	{
+		startPoint[n] = FindPoint(segments[n].start);
+		endPoint[n] = FindPoint(segments[n].end);
+		if(!segments[n].reversible)
+			leadsInCount[endPoint[n]]++;
+	}
+}
+
+// Returns -1 if no segment ends at point
+int ControlSegmentIndex::FindPoint(Coord& point)
+{
+	uint32_t key = PointKey(point);
+	auto found = lower_bound(pointKeys.begin(), pointKeys.end(), key);
+	
+	if(found == pointKeys.end() || *found != key)
+		return -1;
+	return (int) (found - pointKeys.begin());
+}
+
+void ControlSegmentIndex::Use(size_t n)
+{
+	used[n] = true;
+	
+	unusedCount[startPoint[n]]--;
+	if(endPoint[n] != startPoint[n])
+		unusedCount[endPoint[n]]--;
+	if(!segments[n].reversible)
+		leadsInCount[endPoint[n]]--;
+	
+	while(firstUnused < segments.size() && used[firstUnused])
+		firstUnused++;
+}
+
+// Counts the unused segments other than skip that touch point, and whether
+// any of them can only be drawn ending there. skip must be unused.
+int ControlSegmentIndex::CountAt(size_t skip, Coord& point, bool& leadsIn)
+{
+	int p = FindPoint(point);
+	
+	if(p < 0)
+	{
+		leadsIn = false;
+		return 0;
+	}
+	
+	int count = unusedCount[p];
+	int leadsInHere = leadsInCount[p];
+	
+	if(startPoint[skip] == p || endPoint[skip] == p)
+		count--;
+	if(!segments[skip].reversible && endPoint[skip] == p)
+		leadsInHere--;
+	
+	leadsIn = leadsInHere > 0;
+	return count;
+}
+
+// Finds the first unused segment that can be drawn starting at point, marks it
+// used and returns it in segment, turned round if need be
+bool ControlSegmentIndex::UseNextFrom(Coord point, ControlSegment& segment)
+{
+	int p = FindPoint(point);
+	if(p < 0)
+		return false;
+	
+	for(int e = firstEntry[p]; e < firstEntry[p + 1]; e++)
+	{
+		size_t n = entries[e].segment;
+		if(used[n])
+			continue;
+		
+		ControlSegment& next = segments[n];
+		if(next.start.x == point.x && next.start.y == point.y)
+		{
+			segment = next;
+		}
+		else if(next.reversible)
+		{
+			segment.start = next.end;
+			segment.end = next.start;
+		}
+		else
+		{
+			continue;
+		}
+		
+		Use(n);
+		return true;
+	}
+	return false;
+}
+
+// Control lines all go in at the end with the visual screen off: blocking
+// lines (colour 0xf) in priority 0, then everything else in priority 2. Within
+// each class the order does not matter, so segments are chained end to start
+// to make long polylines.
+void Converter::EmitControlLines()
+{
+	static const uint8_t classPriority[2] = { 0, 2 };
+	vector<ControlLine> classes[2];
+	
+	for(ControlLine& line : controlLines)
+	{
+		classes[line.colour == 0xf ? 0 : 1].push_back(line);
+	}
+	
+	for(int c = 0; c < 2; c++)
+	{
+		if(classes[c].size() == 0)
+			continue;
+		
+		vector<ControlSegment> segments;
+		MergeControlLines(classes[c], segments);
+		
+		EmitAgiSetVisual(COLOUR_DISABLED);
+		EmitAgiSetPriority(classPriority[c]);
+		
+		ControlSegmentIndex index(segments);
+		
+		while(index.firstUnused < segments.size())
+		{
+			// Like an Euler path, start where nothing has to lead in and preferably
+			// where an odd number of segments meet, so chains are as long as possible
+			size_t first = segments.size();
+			bool reverse = false;
+			int bestRank = 0;
+			
+			for(size_t n = index.firstUnused; n < segments.size() && bestRank < 2; n++)
+			{
+				if(index.used[n])
+					continue;
+				
+				for(int end = 0; end < (segments[n].reversible ? 2 : 1); end++)
+				{
+					bool leadsIn;
+					int others = index.CountAt(n, end ? segments[n].end : segments[n].start, leadsIn);
+					int rank = leadsIn ? 0 : (others % 2 == 0 ? 2 : 1);
+					
+					if(first == segments.size() || rank > bestRank)
+					{
+						first = n;
+						reverse = end == 1;
+						bestRank = rank;
+					}
+				}
+			}
+			
+			ControlSegment segment = segments[first];
+			if(reverse)
+			{
+				segment.start = segments[first].end;
+				segment.end = segments[first].start;
+			}
+			index.Use(first);
+			
+			do
+			{
+				EmitAgiLine(segment.start.x, segment.start.y, segment.end.x, segment.end.y);
+				agiCanvas.DrawLine(segment.start.x, segment.start.y, segment.end.x, segment.end.y);
+			}
+			while(index.UseNextFrom(segment.end, segment));
+		}
+	}
+}
+
+void DecodeAgiPicture(ByteSpan bytes, vector<AgiOp>& ops)
+{
+	ops.clear();
+	
+	for(int n = 0; n < (int) bytes.length; )
+	{
+		AgiOp op;
+		op.instruction = bytes.data[n];
+		op.start = n;
+		
+		for(n++; n < (int) bytes.length && !IsInstruction(bytes.data[n]); n++);
+		
+		op.length = n - op.start;
+		ops.push_back(op);
+	}
+}
+
+// The points a line op joins or the seeds of a fill op
+void GetAgiOpPoints(ByteSpan bytes, AgiOp& op, vector<Coord>& points)
+{
+	const uint8_t* args = bytes.data + op.start + 1;
+	int numArgs = op.length - 1;
+	
+	points.clear();
+	
+	if(numArgs < 2)
+		return;
+	
+	Coord point(args[0], args[1]);
+	points.push_back(point);
+	
+	switch(op.instruction)
+	{
+		case AGI_LINE_INSTRUCTION:
+		case AGI_FILL_INSTRUCTION:
+		for(int n = 2; n + 1 < numArgs; n += 2)
+		{
+			points.push_back(Coord(args[n], args[n + 1]));
+		}
+		break;
+		
+		case AGI_RELATIVE_LINE_INSTRUCTION:
+		for(int n = 2; n < numArgs; n++)
+		{
+			point.x += (args[n] & 0x80) ? -((args[n] >> 4) & 7) : (args[n] >> 4);
+			point.y += (args[n] & 0x08) ? -(args[n] & 7) : (args[n] & 7);
+			points.push_back(point);
+		}
+		break;
+		
+		case AGI_Y_CORNER_INSTRUCTION:
+		case AGI_X_CORNER_INSTRUCTION:
+		for(int n = 2; n < numArgs; n++)
+		{
+			bool firstAxis = n % 2 == 0;
+			if(firstAxis == (op.instruction == AGI_Y_CORNER_INSTRUCTION))
+				point.y = args[n];
+			else
+				point.x = args[n];
+			points.push_back(point);
+		}
+		break;
+	}
+}
+
+// The brushes of a plot op, which only carries textures if the pattern uses them
+void GetAgiOpBrushes(ByteSpan bytes, AgiOp& op, uint8_t patternCode, vector<AgiBrush>& brushes)
+{
+	const uint8_t* args = bytes.data + op.start + 1;
+	int numArgs = op.length - 1;
+	int stride = (patternCode & SCI_PATTERN_CODE_USE_TEXTURE) ? 3 : 2;
+	
+	brushes.clear();
+	
+	for(int n = 0; n + stride <= numArgs; n += stride)
+	{
+		AgiBrush brush = { patternCode, 0, args[n + stride - 2], args[n + stride - 1] };
+		if(stride == 3)
+			brush.texture = (args[n] >> 1) & 0x7f;
+		brushes.push_back(brush);
+	}
+}
+
+// Draws one op the way the AGI interpreter would, adding every pixel it writes
+// to written if given
+void RenderAgiOp(ByteSpan bytes, AgiOp& op, AgiCanvas& canvas, uint8_t& patternCode, vector<Coord>* written)
+{
+	const uint8_t* args = bytes.data + op.start + 1;
+	vector<Coord> points;
+	vector<Coord> filled;
+	
+	switch(op.instruction)
+	{
+		case AGI_SET_VISUAL:
+		canvas.penColour = args[0];
+		break;
+		case AGI_DISABLE_VISUAL:
+		canvas.penColour = COLOUR_DISABLED;
+		break;
+		case AGI_SET_PRIORITY:
+		canvas.priorityColour = args[0];
+		break;
+		case AGI_DISABLE_PRIORITY:
+		canvas.priorityColour = COLOUR_DISABLED;
+		break;
+		
+		case AGI_Y_CORNER_INSTRUCTION:
+		case AGI_X_CORNER_INSTRUCTION:
+		case AGI_LINE_INSTRUCTION:
+		case AGI_RELATIVE_LINE_INSTRUCTION:
+		{
+			auto plot = [&canvas, written](int x, int y)
+			{
+				canvas.SetPixel(x, y);
+				if(written)
+					written->push_back(Coord(x, y));
+			};
+			
+			GetAgiOpPoints(bytes, op, points);
+			if(points.size() == 1)
+			{
+				plot(points[0].x, points[0].y);
+			}
+			for(size_t n = 1; n < points.size(); n++)
+			{
+				RasterizeLine(points[n - 1].x, points[n - 1].y, points[n].x, points[n].y, plot);
+			}
+		}
+		break;
+		
+		case AGI_FILL_INSTRUCTION:
+		GetAgiOpPoints(bytes, op, points);
+		for(Coord& seed : points)
+		{
+			canvas.Fill(seed.x, seed.y, written ? &filled : nullptr);
+			if(written)
+				written->insert(written->end(), filled.begin(), filled.end());
+		}
+		break;
+		
+		case AGI_SET_PATTERN:
+		patternCode = args[0];
+		break;
+		
+		case AGI_PLOT_INSTRUCTION:
+		{
+			vector<AgiBrush> brushes;
+			GetAgiOpBrushes(bytes, op, patternCode, brushes);
+			for(AgiBrush& brush : brushes)
+			{
+				DrawAgiBrush(canvas, patternCode, brush.texture, brush.x, brush.y, written);
+			}
+		}
+		break;
+	}
+}
+
+bool IsAgiDrawOp(uint8_t instruction)
+{
+	return (instruction >= AGI_Y_CORNER_INSTRUCTION && instruction <= AGI_FILL_INSTRUCTION) || instruction == AGI_PLOT_INSTRUCTION;
+}
+
+// Renders the ops that are not removed and compares the result with expected
+bool RendersSame(ByteSpan bytes, vector<AgiOp>& ops, vector<bool>& removed, AgiCanvas& expected)
+{
+	AgiCanvas canvas;
+	uint8_t patternCode = 0;
+	
+	for(size_t n = 0; n < ops.size(); n++)
+	{
+		if(!removed[n])
+		{
+			RenderAgiOp(bytes, ops[n], canvas, patternCode, nullptr);
+		}
+	}
+	
+	return canvas.SamePixels(expected);
+}
+
+// Renders the picture without op skipped, starting from before, the canvas
+// just before it. Everything after a checkpoint with the same pixels renders
+// as it did with the op, so the replay stops there.
+bool RendersSameWithout(ByteSpan bytes, vector<AgiOp>& ops, size_t skipped, const AgiCanvas& before, uint8_t patternCode,
+	vector<AgiCanvas>& checkpoints, AgiCanvas& expected)
+{
+	AgiCanvas canvas = before;
+	
+	for(size_t n = skipped + 1; n < ops.size(); n++)
+	{
+		if(n % OVERDRAW_CHECKPOINT_INTERVAL == 0 && canvas.SamePixels(checkpoints[n / OVERDRAW_CHECKPOINT_INTERVAL]))
+			return true;
+		
+		RenderAgiOp(bytes, ops[n], canvas, patternCode, nullptr);
+	}
+	
+	return canvas.SamePixels(expected);
+}
+
+// Pixels of one plane that differ between two canvases and the box around them
+struct PlaneDiff
+{
+	PlaneDiff() : count(0), left(0), top(0), right(-1), bottom(-1) {}
+	
+	void Add(int x, int y, int pixels);
+	
+	int count;
+	int left, top, right, bottom;
+};
+
+void PlaneDiff::Add(int x, int y, int pixels)
+{
+	if(right < 0)
+	{
+		left = right = x;
+		top = y;
+	}
+	
+	if(x < left)
+		left = x;
+	if(x > right)
+		right = x;
+	bottom = y;
+	count += pixels;
+}
+
+// Compares pictures of the same size given by their rows of packed pixels,
+// eight pixels at a time. Only words that differ are looked at pixel by pixel,
+// to find the edges of the boxes.
+void DiffPixelRows(const uint8_t* const* rowsA, const uint8_t* const* rowsB, int width, int height, PlaneDiff& visual, PlaneDiff& priority)
+{
+	const uint64_t visualBits = 0x0f0f0f0f0f0f0f0full;
+	const uint64_t lowBits = 0x0101010101010101ull;
+	
+	for(int y = 0; y < height; y++)
+	{
+		const uint8_t* rowA = rowsA[y];
+		const uint8_t* rowB = rowsB[y];
+		
+		for(int x = 0; x < width; x += 8)
+		{
+			int pixels = width - x < 8 ? width - x : 8;
+			uint64_t wordA = 0;
+			uint64_t wordB = 0;
+			memcpy(&wordA, rowA + x, pixels);
+			memcpy(&wordB, rowB + x, pixels);
+			
+			uint64_t difference = wordA ^ wordB;
+			if(!difference)
+				continue;
+			
+			for(int plane = 0; plane < 2; plane++)
+			{
+				uint64_t planeDifference = plane == 0 ? difference & visualBits : (difference >> 4) & visualBits;
+				if(!planeDifference)
+					continue;
+				
+				// One bit at the bottom of each byte whose nibble differs
+				uint64_t differingPixels = (planeDifference | (planeDifference >> 1) | (planeDifference >> 2) | (planeDifference >> 3)) & lowBits;
+				PlaneDiff& diff = plane == 0 ? visual : priority;
+				int first = 0;
+				int last = 7;
+				
+				while(!(differingPixels & (0xffull << (first * 8))))
+					first++;
+				while(!(differingPixels & (0xffull << (last * 8))))
+					last--;
+				
+				diff.Add(x + first, y, 0);
+				diff.Add(x + last, y, CountSetBits(differingPixels));
+			}
+		}
+	}
+}
+
+// The AGI picture renderer from pic2png's PicDrawer, ported at 160x168 for -c
+// to check the output against. It shares no drawing code or tables with the
+// converter, so a mistake there cannot hide itself, and it keeps PicDrawer's
+// rules where they differ from Canvas: fills are refused while the last
+// visual colour set is white even once visual drawing is off, a fill skips
+// pixels the same fill op already reached, and brushes are clamped and step
+// through their bits the way plotPattern does it.
+struct AgiReferencePicture
+{
+	AgiReferencePicture();
+	
+	bool Render(ByteSpan picture);
+	
+	uint8_t NextByte();
+	void SetPixel(uint16_t x, uint16_t y);
+	void DrawLine(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2);
+	bool OkToFill(uint16_t x, uint16_t y);
+	bool CanFillNext(uint16_t x, uint16_t y);
+	void Fill(uint16_t x, uint16_t y);
+	void PlotPattern(uint8_t x, uint8_t y);
+	
+	void DrawXCorner();
+	void DrawYCorner();
+	void DrawRelativeLines();
+	void DrawAbsoluteLines();
+	void DrawFills();
+	void PlotBrushes();
+	
+	// Visual colour in the low nibble and priority in the high one, as in Canvas
+	uint8_t pixels[AGI_PICTURE_HEIGHT][AGI_PICTURE_WIDTH];
+	const uint8_t* pixelRows[AGI_PICTURE_HEIGHT];
+	
+	// Pixels the current fill op has reached
+	bool lastFill[AGI_PICTURE_HEIGHT][AGI_PICTURE_WIDTH];
+	vector<Coord> fillSeeds;
+	
+	ByteSpan bytes;
+	size_t position;
+	
+	bool visualEnabled, priorityEnabled;
+	uint8_t visualColour, priorityColour;
+	uint8_t patternCode, patternNumber;
+};
+
+AgiReferencePicture::AgiReferencePicture() : position(0),
+	visualEnabled(false), priorityEnabled(false), visualColour(0), priorityColour(0), patternCode(0), patternNumber(0)
+{
+	memset(pixels, 0x4f, sizeof(pixels));
+	memset(lastFill, 0, sizeof(lastFill));
+	
+	for(int y = 0; y < AGI_PICTURE_HEIGHT; y++)
+	{
+		pixelRows[y] = pixels[y];
+	}
+}
+
+// Past the end reads as the end of picture code, which stops every op
+uint8_t AgiReferencePicture::NextByte()
+{
+	uint8_t value = position < bytes.length ? bytes.data[position] : 0xff;
+	position++;
+	return value;
+}
+
+void AgiReferencePicture::SetPixel(uint16_t x, uint16_t y)
+{
+	if(x >= AGI_PICTURE_WIDTH || y >= AGI_PICTURE_HEIGHT)
+		return;
+	
+	if(visualEnabled)
+		pixels[y][x] = (pixels[y][x] & 0xf0) | (visualColour & 0xf);
+	if(priorityEnabled)
+		pixels[y][x] = (pixels[y][x] & 0x0f) | (priorityColour << 4);
+}
+
+void AgiReferencePicture::DrawLine(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2)
+{
+	int width = abs(x2 - x1);
+	int height = abs(y2 - y1);
+	int stepX = x2 < x1 ? -1 : 1;
+	int stepY = y2 < y1 ? -1 : 1;
+	
+	if(width > height)
+	{
+		int error = width / 2;
+		int y = y1;
+		for(int x = x1; x != x2; x += stepX)
+		{
+			SetPixel(x, y);
+			error += height;
+			if(error >= width)
+			{
+				error -= width;
+				y += stepY;
+			}
+		}
+	}
+	else
+	{
+		int error = height / 2;
+		int x = x1;
+		for(int y = y1; y != y2; y += stepY)
+		{
+			SetPixel(x, y);
+			error += width;
+			if(error >= height)
+			{
+				error -= height;
+				x += stepX;
+			}
+		}
+	}
+	SetPixel(x2, y2);
+}
+
+bool AgiReferencePicture::OkToFill(uint16_t x, uint16_t y)
+{
+	if(!visualEnabled && !priorityEnabled)
+		return false;
+	if(visualColour == 15)
+		return false;
+	if(x >= AGI_PICTURE_WIDTH || y >= AGI_PICTURE_HEIGHT)
+		return false;
+	
+	if(priorityEnabled && !visualEnabled)
+		return (pixels[y][x] >> 4) == 4;
+	return (pixels[y][x] & 0xf) == 15;
+}
+
+bool AgiReferencePicture::CanFillNext(uint16_t x, uint16_t y)
+{
+	return OkToFill(x, y) && !lastFill[y][x];
+}
+
+void AgiReferencePicture::Fill(uint16_t x, uint16_t y)
+{
+	if(x >= AGI_PICTURE_WIDTH || y >= AGI_PICTURE_HEIGHT || !CanFillNext(x, y))
+		return;
+	
+	fillSeeds.clear();
+	fillSeeds.push_back(Coord(x, y));
+	
+	while(fillSeeds.size() > 0)
+	{
+		Coord seed = fillSeeds.back();
+		fillSeeds.pop_back();
+		
+		if(!CanFillNext(seed.x, seed.y))
+			continue;
+		
+		int left = seed.x;
+		int right = seed.x;
+		while(left > 0 && CanFillNext(left - 1, seed.y))
+			left--;
+		while(right < AGI_PICTURE_WIDTH - 1 && CanFillNext(right + 1, seed.y))
+			right++;
+		
+		for(int i = left; i <= right; i++)
+		{
+			SetPixel(i, seed.y);
+			lastFill[seed.y][i] = true;
+		}
+		
+		for(int row = seed.y - 1; row <= seed.y + 1; row += 2)
+		{
+			bool inRun = false;
+			
+			if(row < 0 || row >= AGI_PICTURE_HEIGHT)
+				continue;
+			
+			for(int i = left; i <= right; i++)
+			{
+				if(CanFillNext(i, row))
+				{
+					if(!inRun)
+						fillSeeds.push_back(Coord(i, row));
+					inRun = true;
+				}
+				else
+				{
+					inRun = false;
+				}
+			}
+		}
+	}
+}
+
+void AgiReferencePicture::PlotPattern(uint8_t x, uint8_t y)
+{
+	static const uint8_t circles[8][15] =
+	{
+		{ 0x80 },
+		{ 0xfc },
+		{ 0x5f, 0xf4 },
+		{ 0x66, 0xff, 0xf6, 0x60 },
+		{ 0x23, 0xbf, 0xff, 0xff, 0xee, 0x20 },
+		{ 0x31, 0xe7, 0x9e, 0xff, 0xff, 0xde, 0x79, 0xe3, 0x00 },
+		{ 0x38, 0xf9, 0xf3, 0xef, 0xff, 0xff, 0xff, 0xfe, 0xf9, 0xf3, 0xe3, 0x80 },
+		{ 0x18, 0x3c, 0x7e, 0x7e, 0x7e, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7e, 0x7e, 0x7e, 0x3c, 0x18 }
+	};
+	
+	static const uint8_t splatterMap[32] =
+	{
+		0x20, 0x94, 0x02, 0x24, 0x90, 0x82, 0xa4, 0xa2,
+		0x82, 0x09, 0x0a, 0x22, 0x12, 0x10, 0x42, 0x14,
+		0x91, 0x4a, 0x91, 0x11, 0x08, 0x12, 0x25, 0x10,
+		0x22, 0xa8, 0x14, 0x24, 0x00, 0x50, 0x24, 0x04
+	};
+	
+	static const uint8_t splatterStart[128] =
+	{
+		0x00, 0x18, 0x30, 0xc4, 0xdc, 0x65, 0xeb, 0x48,
+		0x60, 0xbd, 0x89, 0x05, 0x0a, 0xf4, 0x7d, 0x7d,
+		0x85, 0xb0, 0x8e, 0x95, 0x1f, 0x22, 0x0d, 0xdf,
+		0x2a, 0x78, 0xd5, 0x73, 0x1c, 0xb4, 0x40, 0xa1,
+		0xb9, 0x3c, 0xca, 0x58, 0x92, 0x34, 0xcc, 0xce,
+		0xd7, 0x42, 0x90, 0x0f, 0x8b, 0x7f, 0x32, 0xed,
+		0x5c, 0x9d, 0xc8, 0x99, 0xad, 0x4e, 0x56, 0xa6,
+		0xf7, 0x68, 0xb7, 0x25, 0x82, 0x37, 0x3a, 0x51,
+		0x69, 0x26, 0x38, 0x52, 0x9e, 0x9a, 0x4f, 0xa7,
+		0x43, 0x10, 0x80, 0xee, 0x3d, 0x59, 0x35, 0xcf,
+		0x79, 0x74, 0xb5, 0xa2, 0xb1, 0x96, 0x23, 0xe0,
+		0xbe, 0x05, 0xf5, 0x6e, 0x19, 0xc5, 0x66, 0x49,
+		0xf0, 0xd1, 0x54, 0xa9, 0x70, 0x4b, 0xa4, 0xe2,
+		0xe6, 0xe5, 0xab, 0xe4, 0xd2, 0xaa, 0x4c, 0xe3,
+		0x06, 0x6f, 0xc6, 0x4a, 0xa4, 0x75, 0x97, 0xe1
+	};
+	
+	int circlePos = 0;
+	uint8_t bitPos = splatterStart[patternNumber];
+	uint8_t penSize = patternCode & 7;
+	
+	if(x < penSize / 2 + 1)
+		x = penSize / 2 + 1;
+	else if(x > AGI_PICTURE_WIDTH - (penSize / 2 + 1))
+		x = AGI_PICTURE_WIDTH - (penSize / 2 + 1);
+	if(y < penSize)
+		y = penSize;
+	else if(y >= AGI_PICTURE_HEIGHT - penSize)
+		y = AGI_PICTURE_HEIGHT - 1 - penSize;
+	
+	for(uint8_t y1 = y - penSize; y1 <= y + penSize; y1++)
+	{
+		for(uint8_t x1 = x - (penSize + 1) / 2; x1 <= x + penSize / 2; x1++)
+		{
+			// Circles skip the pixels outside their bitmap, and only the pixels
+			// plotted step through the splatter bits
+			if(!(patternCode & 0x10))
+			{
+				bool inCircle = (circles[penSize][circlePos >> 3] >> (7 - (circlePos & 7))) & 1;
+				circlePos++;
+				if(!inCircle)
+					continue;
+			}
+			
+			if(patternCode & 0x20)
+			{
+				if((splatterMap[bitPos >> 3] >> (7 - (bitPos & 7))) & 1)
+					SetPixel(x1, y1);
+				bitPos++;
+				if(bitPos == 0xff)
+					bitPos = 0;
+			}
+			else
+			{
+				SetPixel(x1, y1);
+			}
+		}
+	}
+}
+
+void AgiReferencePicture::DrawXCorner()
+{
+	uint8_t x1 = NextByte();
+	uint8_t y1 = NextByte();
+	
+	SetPixel(x1, y1);
+	
+	for(;;)
+	{
+		uint8_t x2 = NextByte();
+		if(x2 >= 0xf0)
+			break;
+		DrawLine(x1, y1, x2, y1);
+		x1 = x2;
+		
+		uint8_t y2 = NextByte();
+		if(y2 >= 0xf0)
+			break;
+		DrawLine(x1, y1, x1, y2);
+		y1 = y2;
+	}
+	
+	position--;
+}
+
+void AgiReferencePicture::DrawYCorner()
+{
+	uint8_t x1 = NextByte();
+	uint8_t y1 = NextByte();
+	
+	SetPixel(x1, y1);
+	
+	for(;;)
+	{
+		uint8_t y2 = NextByte();
+		if(y2 >= 0xf0)
+			break;
+		DrawLine(x1, y1, x1, y2);
+		y1 = y2;
+		
+		uint8_t x2 = NextByte();
+		if(x2 >= 0xf0)
+			break;
+		DrawLine(x1, y1, x2, y1);
+		x1 = x2;
+	}
+	
+	position--;
+}
+
+// Moves wrap round as unsigned 16 bit coordinates, as in PicDrawer
+void AgiReferencePicture::DrawRelativeLines()
+{
+	uint16_t x1 = NextByte();
+	uint16_t y1 = NextByte();
+	
+	SetPixel(x1, y1);
+	
+	for(;;)
+	{
+		uint8_t disp = NextByte();
+		if(disp >= 0xf0)
+			break;
+		
+		int dx = (disp >> 4) & 0x0f;
+		int dy = disp & 0x0f;
+		if(dx & 0x08)
+			dx = -(dx & 0x07);
+		if(dy & 0x08)
+			dy = -(dy & 0x07);
+		
+		DrawLine(x1, y1, (uint16_t)(x1 + dx), (uint16_t)(y1 + dy));
+		x1 += dx;
+		y1 += dy;
+	}
+	
+	position--;
+}
+
+void AgiReferencePicture::DrawAbsoluteLines()
+{
+	uint16_t x1 = NextByte();
+	uint16_t y1 = NextByte();
+	
+	SetPixel(x1, y1);
+	
+	for(;;)
+	{
+		uint16_t x2 = NextByte();
+		if(x2 >= 0xf0)
+			break;
+		uint16_t y2 = NextByte();
+		if(y2 >= 0xf0)
+			break;
+		
+		DrawLine(x1, y1, x2, y2);
+		x1 = x2;
+		y1 = y2;
+	}
+	
+	position--;
+}
+
+void AgiReferencePicture::DrawFills()
+{
+	memset(lastFill, 0, sizeof(lastFill));
+	
+	for(;;)
+	{
+		uint8_t x = NextByte();
+		if(x >= 0xf0)
+			break;
+		uint8_t y = NextByte();
+		if(y >= 0xf0)
+			break;
+		
+		Fill(x, y);
+	}
+	
+	position--;
+}
+
+void AgiReferencePicture::PlotBrushes()
+{
+	for(;;)
+	{
+		if(patternCode & 0x20)
+		{
+			patternNumber = NextByte();
+			if(patternNumber >= 0xf0)
+				break;
+			patternNumber = (patternNumber >> 1) & 0x7f;
+		}
+		
+		uint8_t x = NextByte();
+		if(x >= 0xf0)
+			break;
+		uint8_t y = NextByte();
+		if(y >= 0xf0)
+			break;
+		
+		PlotPattern(x, y);
+	}
+	
+	position--;
+}
+
+// Returns false if the picture has a code PicDrawer does not know
+bool AgiReferencePicture::Render(ByteSpan picture)
+{
+	bytes = picture;
+	position = 0;
+	
+	while(position < bytes.length)
+	{
+		uint8_t action = NextByte();
+		
+		switch(action)
+		{
+			case 0xff:
+			return true;
+			
+			case 0xf0:
+			visualColour = NextByte();
+			visualEnabled = true;
+			break;
+			case 0xf1:
+			visualEnabled = false;
+			break;
+			case 0xf2:
+			priorityColour = NextByte();
+			priorityEnabled = true;
+			break;
+			case 0xf3:
+			priorityEnabled = false;
+			break;
+			
+			case 0xf4:
+			DrawYCorner();
+			break;
+			case 0xf5:
+			DrawXCorner();
+			break;
+			case 0xf6:
+			DrawAbsoluteLines();
+			break;
+			case 0xf7:
+			DrawRelativeLines();
+			break;
+			case 0xf8:
+			DrawFills();
+			break;
+			case 0xf9:
+			patternCode = NextByte();
+			break;
+			case 0xfa:
+			PlotBrushes();
+			break;
+			
+			default:
+			printf("Verify failed: unknown picture code %X at %d\n", action, (int) position - 1);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+// Counts fills run with only priority drawing on while the last visual colour
+// set is white. pic2png refuses them and Canvas does not, so the converter
+// never writes one.
+int CountFillsAfterWhite(ByteSpan bytes, vector<AgiOp>& ops)
+{
+	int count = 0;
+	uint8_t visualColour = 0;
+	bool visualEnabled = false;
+	bool priorityEnabled = false;
+	
+	for(AgiOp& op : ops)
+	{
+		switch(op.instruction)
+		{
+			case AGI_SET_VISUAL:
+			visualColour = bytes.data[op.start + 1];
+			visualEnabled = true;
+			break;
+			
+			case AGI_DISABLE_VISUAL:
+			visualEnabled = false;
+			break;
+			
+			case AGI_SET_PRIORITY:
+			priorityEnabled = true;
+			break;
+			
+			case AGI_DISABLE_PRIORITY:
+			priorityEnabled = false;
+			break;
+			
+			case AGI_FILL_INSTRUCTION:
+			if(!visualEnabled && priorityEnabled && visualColour == 15)
+				count++;
+			break;
+		}
+	}
+	
+	return count;
+}
+
+// Renders the emitted picture with AgiReferencePicture and reports where it
+// differs from the canvas it was built from. Returns the number of differing
+// pixels over both planes plus the number of fills pic2png refuses after
+// white, or -1 if the picture could not be rendered.
+int VerifyOutput(ByteSpan bytes, AgiCanvas& expected)
+{
+	AgiReferencePicture reference;
+	
+	if(!reference.Render(bytes))
+		return -1;
+	
+	vector<AgiOp> ops;
+	DecodeAgiPicture(bytes, ops);
+	int fillsAfterWhite = CountFillsAfterWhite(bytes, ops);
+	
+	PlaneDiff visual;
+	PlaneDiff priority;
+	DiffPixelRows(reference.pixelRows, expected.pixelRows, AGI_PICTURE_WIDTH, AGI_PICTURE_HEIGHT, visual, priority);
+	
+	if(fillsAfterWhite > 0)
+		printf("Verify failed: %d fills run with only priority on after white, which pic2png refuses\n", fillsAfterWhite);
+	
+	if(visual.count == 0 && priority.count == 0 && fillsAfterWhite == 0)
+	{
+		printf("Verified: output renders in pic2png the same as the AGI canvas\n");
+		return 0;
+	}
+	
+	if(visual.count > 0)
+		printf("Verify failed: %d visual pixels differ within %d, %d - %d, %d\n", visual.count, visual.left, visual.top, visual.right, visual.bottom);
+	if(priority.count > 0)
+		printf("Verify failed: %d priority pixels differ within %d, %d - %d, %d\n", priority.count, priority.left, priority.top, priority.right, priority.bottom);
+	
+	return visual.count + priority.count + fillsAfterWhite;
+}
+
+// Removes draw ops that are completely covered by later ones. A draw op is only
+// tried if it is not the last to write any pixel, and only removed if the whole
+// picture still renders the same, which catches ops a later fill relies on.
+// Each try replays from the op onwards on a copy of the canvas before it.
+// The rest is re-emitted so colour changes left with nothing to draw go away
+// and lines that now meet are joined.
+void Converter::EliminateOverdraw()
+{
+	vector<AgiOp> ops;
+	ByteSpan bytes = Output();
+	DecodeAgiPicture(bytes, ops);
+	
+	AgiCanvas expected;
+	vector<int> visualOwner(AGI_PICTURE_WIDTH * AGI_PICTURE_HEIGHT, -1);
+	vector<int> priorityOwner(AGI_PICTURE_WIDTH * AGI_PICTURE_HEIGHT, -1);
+	vector<AgiCanvas> checkpoints;
+	vector<Coord> written;
+	uint8_t agiPattern = 0;
+	
+	for(size_t n = 0; n < ops.size(); n++)
+	{
+		if(n % OVERDRAW_CHECKPOINT_INTERVAL == 0)
+			checkpoints.push_back(expected);
+		
+		written.clear();
+		RenderAgiOp(bytes, ops[n], expected, agiPattern, &written);
+		
+		for(Coord& c : written)
+		{
+			if(expected.penColour != COLOUR_DISABLED)
+				visualOwner[c.y * AGI_PICTURE_WIDTH + c.x] = (int) n;
+			if(expected.priorityColour != COLOUR_DISABLED)
+				priorityOwner[c.y * AGI_PICTURE_WIDTH + c.x] = (int) n;
+		}
+	}
+	
+	vector<bool> visible(ops.size(), false);
+	for(size_t n = 0; n < visualOwner.size(); n++)
+	{
+		if(visualOwner[n] >= 0)
+			visible[visualOwner[n]] = true;
+		if(priorityOwner[n] >= 0)
+			visible[priorityOwner[n]] = true;
+	}
+	
+	vector<bool> removed(ops.size(), false);
+	bool anyRemoved = false;
+	
+	// The picture up to op n, less the ops removed so far
+	AgiCanvas canvas;
+	agiPattern = 0;
+	
+	for(size_t n = 0; n < ops.size(); n++)
+	{
+		if(IsAgiDrawOp(ops[n].instruction) && !visible[n] && RendersSameWithout(bytes, ops, n, canvas, agiPattern, checkpoints, expected))
+		{
+			removed[n] = true;
+			anyRemoved = true;
+			continue;
+		}
+		
+		RenderAgiOp(bytes, ops[n], canvas, agiPattern, nullptr);
+	}
+	
+	if(!anyRemoved)
+		return;
+	
+	vector<uint8_t> original;
+	original.swap(output);
+	bytes.data = original.data();
+	
+	penColour = COLOUR_DISABLED;
+	priorityColour = COLOUR_DISABLED;
+	lastVisualColour = 0;
+	agiPatternCode = 0xff;
+	
+	vector<Coord> points;
+	vector<AgiBrush> brushes;
+	agiPattern = 0;
+	
+	for(size_t n = 0; n < ops.size(); n++)
+	{
+		AgiOp& op = ops[n];
+		const uint8_t* args = bytes.data + op.start + 1;
+		
+		if(removed[n])
+			continue;
+		
+		switch(op.instruction)
+		{
+			case AGI_SET_VISUAL:
+			case AGI_DISABLE_VISUAL:
+			case AGI_SET_PRIORITY:
+			case AGI_DISABLE_PRIORITY:
+			{
+				// Skip the change if the plane changes again before anything is drawn
+				size_t next = n + 1;
+				bool visualOp = op.instruction == AGI_SET_VISUAL || op.instruction == AGI_DISABLE_VISUAL;
+				bool overridden = false;
+				
+				for(; next < ops.size(); next++)
+				{
+					uint8_t instruction = ops[next].instruction;
+					if(removed[next])
+						continue;
+					if(IsAgiDrawOp(instruction) || instruction == 0xff)
+						break;
+					if(visualOp == (instruction == AGI_SET_VISUAL || instruction == AGI_DISABLE_VISUAL))
+					{
+						overridden = true;
+						break;
+					}
+				}
+				
+				if(overridden)
+					break;
+				
+				if(op.instruction == AGI_SET_VISUAL)
+					EmitAgiSetVisual(args[0]);
+				else if(op.instruction == AGI_DISABLE_VISUAL)
+					EmitAgiSetVisual(COLOUR_DISABLED);
+				else if(op.instruction == AGI_SET_PRIORITY)
+					EmitAgiSetPriority(args[0]);
+				else
+					EmitAgiSetPriority(COLOUR_DISABLED);
+			}
+			break;
+			
+			case AGI_Y_CORNER_INSTRUCTION:
+			case AGI_X_CORNER_INSTRUCTION:
+			case AGI_LINE_INSTRUCTION:
+			case AGI_RELATIVE_LINE_INSTRUCTION:
+			GetAgiOpPoints(bytes, op, points);
+			if(points.size() == 1)
+			{
+				EmitAgiLine(points[0].x, points[0].y, points[0].x, points[0].y);
+			}
+			for(size_t p = 1; p < points.size(); p++)
+			{
+				EmitAgiLine(points[p - 1].x, points[p - 1].y, points[p].x, points[p].y);
+			}
+			break;
+			
+			case AGI_FILL_INSTRUCTION:
+			GetAgiOpPoints(bytes, op, points);
+			for(Coord& seed : points)
+			{
+				EmitAgiFill(seed.x, seed.y);
+			}
+			break;
+			
+			case AGI_SET_PATTERN:
+			// Set again by FlushDots or FlushBrushes when something is plotted with it
+			agiPattern = args[0];
+			break;
+			
+			case AGI_PLOT_INSTRUCTION:
+			GetAgiOpBrushes(bytes, op, agiPattern, brushes);
+			for(AgiBrush& brush : brushes)
+			{
+				if(agiPattern == 0)
+					EmitAgiDot(brush.x < 1 ? 1 : brush.x, brush.y);
+				else
+					EmitAgiBrush(agiPattern, brush.texture, brush.x, brush.y);
+			}
+			break;
+			
+			default:
+			EmitAgiInstruction(op.instruction);
+			for(int a = 1; a < op.length; a++)
+			{
+				WriteByte(args[a - 1]);
+			}
+			break;
+		}
+	}
+	
+	// Should never happen, but the pass must not change the picture
+	vector<AgiOp> newOps;
+	DecodeAgiPicture(Output(), newOps);
+	vector<bool> noneRemoved(newOps.size(), false);
+	if(!RendersSame(Output(), newOps, noneRemoved, expected))
+	{
+		output.swap(original);
+	}
+}
+
+void Converter::Convert(vector<SciOp>& ops)
+{
+	RunOps(ops, ops.size());
+	Finish();
+}
+
+// Carries on from wherever this converter or the snapshot it was copied from
+// stopped, up to but not including op last
+void Converter::RunOps(vector<SciOp>& ops, size_t last)
+{
+	for(; opsRun < last; opsRun++)
+	{
+		ExecuteSciOp(ops[opsRun]);
+	}
+}
+
+Converter* Converter::Snapshot()
+{
+	return new Converter(*this);
+}
+
+void Converter::Finish()
+{
+	EmitControlLines();
+
+	EmitAgiInstruction(0xff);
+	
+	EliminateOverdraw();
+}
+
+// Drawn SCI pixels that fall above or below the AGI picture at this offset,
+// in AGI pixels
+int Converter::CountClippedPixels()
+{
+	int clipped = 0;
+	
+	for(int y = 0; y < SCI_PICTURE_HEIGHT; y++)
+	{
+		if(SCI_TO_AGI_Y(y) >= 0 && SCI_TO_AGI_Y(y) < AGI_PICTURE_HEIGHT)
+			continue;
 		
-		case 1:		// Set whole palette
+		for(int x = 0; x < SCI_PICTURE_WIDTH; x++)
 		{
-			uint8_t pixel = NextByte();
-			for(int c = 0; c < PIC_EGAPALETTE_SIZE; c++)
+			if(sciCanvas.GetVisualPixel(x, y) != sciCanvas.blankVisual || sciCanvas.GetPriorityPixel(x, y) != sciCanvas.blankPriority)
 			{
-				NextByte();
+				clipped++;
 			}
 		}
-		break;
-		
-		case 2:		// Set monochrome palette
+	}
+	
+	return clipped / 2;
+}
+
+uint64_t HashBytes(uint64_t hash, const void* data, size_t length)
+{
+	const uint8_t* bytes = (const uint8_t*) data;
+	
+	for(size_t n = 0; n < length; n++)
+	{
+		hash = (hash ^ bytes[n]) * FNV_PRIME;
+	}
+	
+	return hash;
+}
+
+struct PrefixCacheEntry
+{
+	uint64_t hash;
+	
+	// The picture the snapshot was taken from, shared by all its entries
+	shared_ptr<vector<SciOp>> ops;
+	Converter* snapshot;
+};
+
+// Converter snapshots from pictures already converted, keyed by a hash of the
+// offset and the ops run before them. Pictures often start the same way as
+// another one (day and night versions, a room with one prop removed), and
+// those only have to run the ops after where the two differ. Entries are kept
+// most recently used first, and only PREFIX_CACHE_MAX_SNAPSHOTS of them.
+struct PrefixCache
+{
+	PrefixCache() : opsRun(0), opsResumed(0) {}
+	~PrefixCache();
+	
+	Converter* Convert(shared_ptr<vector<SciOp>> ops, int offsetY);
+	void Insert(uint64_t hash, shared_ptr<vector<SciOp>> ops, Converter* snapshot);
+	
+	mutex lock;
+	list<PrefixCacheEntry> entries;
+	unordered_multimap<uint64_t, list<PrefixCacheEntry>::iterator> byHash;
+	
+	long opsRun;
+	long opsResumed;
+};
+
+PrefixCache::~PrefixCache()
+{
+	for(PrefixCacheEntry& entry : entries)
+	{
+		delete entry.snapshot;
+	}
+}
+
+// Adds a snapshot and drops the least recently used one if that makes too
+// many. The lock must be held.
+void PrefixCache::Insert(uint64_t hash, shared_ptr<vector<SciOp>> ops, Converter* snapshot)
+{
+	PrefixCacheEntry entry = { hash, ops, snapshot };
+	entries.push_front(entry);
+	byHash.insert(make_pair(hash, entries.begin()));
+	
+	if(entries.size() <= PREFIX_CACHE_MAX_SNAPSHOTS)
+		return;
+	
+	auto oldest = prev(entries.end());
+	auto range = byHash.equal_range(oldest->hash);
+	for(auto it = range.first; it != range.second; ++it)
+	{
+		if(it->second == oldest)
 		{
-			pictureDataPtr += 41;
+			byHash.erase(it);
+			break;
 		}
-		break;
+	}
+	
+	delete oldest->snapshot;
+	entries.erase(oldest);
+}
+
+Converter* PrefixCache::Convert(shared_ptr<vector<SciOp>> ops, int offsetY)
+{
+	vector<SciOp>& picture = *ops;
+	
+	// Hashes of the prefixes a snapshot is kept for, every PREFIX_CACHE_INTERVAL ops
+	vector<uint64_t> hashes;
+	uint64_t hash = HashBytes(FNV_OFFSET_BASIS, &offsetY, sizeof(offsetY));
+	hashes.push_back(hash);
+	
+	for(size_t n = 0; n < picture.size(); n++)
+	{
+		hash = HashBytes(hash, &picture[n], sizeof(SciOp));
+		if((n + 1) % PREFIX_CACHE_INTERVAL == 0)
+			hashes.push_back(hash);
+	}
+	
+	Converter* converter = nullptr;
+	
+	{
+		lock_guard<mutex> guard(lock);
 		
-		case 3:
-		case 4:
+		// Resume from the longest prefix that is really the same, not just the same hash
+		for(size_t prefix = hashes.size() - 1; prefix > 0 && !converter; prefix--)
 		{
-			NextByte();
+			size_t length = prefix * PREFIX_CACHE_INTERVAL;
+			auto range = byHash.equal_range(hashes[prefix]);
+			
+			for(auto it = range.first; it != range.second; ++it)
+			{
+				PrefixCacheEntry& entry = *it->second;
+				if(entry.snapshot->agiOffsetY == offsetY && entry.snapshot->opsRun == length && !memcmp(entry.ops->data(), picture.data(), length * sizeof(SciOp)))
+				{
+					converter = entry.snapshot->Snapshot();
+					entries.splice(entries.begin(), entries, it->second);
+					break;
+				}
+			}
 		}
-		break;
+	}
+	
+	if(!converter)
+	{
+		converter = new Converter(offsetY);
+	}
+	
+	size_t resumedAt = converter->opsRun;
+	
+	for(size_t prefix = resumedAt / PREFIX_CACHE_INTERVAL + 1; prefix < hashes.size(); prefix++)
+	{
+		converter->RunOps(picture, prefix * PREFIX_CACHE_INTERVAL);
 		
-		case 5:
-		case 6:
+		Converter* snapshot = converter->Snapshot();
+		lock_guard<mutex> guard(lock);
+		Insert(hashes[prefix], ops, snapshot);
+	}
+	
+	converter->RunOps(picture, picture.size());
+	converter->Finish();
+	
+	lock_guard<mutex> guard(lock);
+	opsRun += (long)(picture.size() - resumedAt);
+	opsResumed += (long) resumedAt;
+	
+	return converter;
+}
+
+Converter* ConvertPicture(shared_ptr<vector<SciOp>> ops, int offsetY, PrefixCache* cache)
+{
+	if(cache)
+	{
+		return cache->Convert(ops, offsetY);
+	}
+	
+	Converter* converter = new Converter(offsetY);
+	converter->Convert(*ops);
+	return converter;
+}
+
+// Converts the picture at every offset on a pool of threads and returns the
+// converter with the lowest score
+Converter* FindBestOffset(shared_ptr<vector<SciOp>> ops, PrefixCache* cache)
+{
+	int numCandidates = 1 - MIN_AGI_OFFSET_Y;
+	vector<Converter*> candidates(numCandidates, nullptr);
+	
+	// Candidates would interleave their verbose output
+	bool wasVerbose = verbose;
+	verbose = false;
+	
+	atomic<int> nextCandidate(0);
+	int numThreads = (int) thread::hardware_concurrency();
+	if(numThreads < 1)
+		numThreads = 1;
+	if(numThreads > numCandidates)
+		numThreads = numCandidates;
+	
+	vector<thread> workers;
+	for(int n = 0; n < numThreads; n++)
+	{
+		workers.push_back(thread([&]()
 		{
-			
+			for(int index = nextCandidate++; index < numCandidates; index = nextCandidate++)
+			{
+				candidates[index] = ConvertPicture(ops, -index, cache);
+			}
+		}));
+	}
+	for(thread& worker : workers)
+	{
+		worker.join();
+	}
+	
+	verbose = wasVerbose;
+	
+	Converter* best = nullptr;
+	long bestScore = 0;
+	
+	for(Converter* candidate : candidates)
+	{
+		int clipped = candidate->CountClippedPixels();
+		long score = (long) candidate->output.size() + candidate->plugCount * AUTO_OFFSET_PLUG_WEIGHT + clipped * AUTO_OFFSET_CLIP_WEIGHT;
+		
+		if(verbose)
+			printf("Offset %d: %ld bytes, %d plugs, %d pixels clipped\n", candidate->agiOffsetY, (long) candidate->output.size(), candidate->plugCount, clipped);
+		
+		if(!best || score < bestScore)
+		{
+			best = candidate;
+			bestScore = score;
 		}
-		break;
+	}
+	
+	for(Converter* candidate : candidates)
+	{
+		if(candidate != best)
+		{
+			delete candidate;
+		}
+	}
+	
+	return best;
+}
+
+// Writes next to the destination and renames over it, so the output is either
+// the complete new file or whatever was there before
+bool WriteFileAtomic(const char* path, ByteSpan bytes)
+{
+	vector<char> tempPath(path, path + strlen(path));
+	const char* suffix = ".tmp";
+	tempPath.insert(tempPath.end(), suffix, suffix + strlen(suffix) + 1);
+	
+	FILE* file = fopen(tempPath.data(), "wb");
+	if(!file)
+	{
+		return false;
+	}
+	
+	bool written = fwrite(bytes.data, 1, bytes.length, file) == bytes.length;
+	written = fclose(file) == 0 && written;
+	
+#ifdef _WIN32
+	written = written && MoveFileExA(tempPath.data(), path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+	written = written && rename(tempPath.data(), path) == 0;
+#endif
+
+	if(!written)
+	{
+		remove(tempPath.data());
+	}
+	return written;
+}
+
+int round(float aNumber, float dirn)
+{
+   if (dirn < 0)
+      return ((aNumber - floor(aNumber) <= 0.501)? floor(aNumber) : ceil(aNumber));
+   return ((aNumber - floor(aNumber) < 0.499)? floor(aNumber) : ceil(aNumber));
+}
+
+// The original floating point line drawer, only kept for -l to check RasterizeLine against
+void LegacyRasterizeLine(int x1, int y1, int x2, int y2, vector<Coord>& points)
+{
+   int height, width;
+   float x, y, addX, addY;
+
+   height = (y2 - y1);
+   width = (x2 - x1);
+   addX = (height==0?height:(float)width/abs(height));
+   addY = (width==0?width:(float)height/abs(width));
+
+   if (abs(width) > abs(height)) 
+   {
+      y = y1;
+      addX = (width == 0? 0 : (width/abs(width)));
+      for (x=x1; x!=x2; x+=addX) 
+	  {
+		points.push_back(Coord(round(x, addX), round(y, addY)));
+		y += addY;
+      }
+      points.push_back(Coord(x2, y2));
+   }
+   else 
+   {
+      x = x1;
+      addY = (height == 0? 0 : (height/abs(height)));
+      for (y=y1; y!=y2; y+=addY) 
+	  {
+		points.push_back(Coord(round(x, addX), round(y, addY)));
+		x+=addX;
+      }
+      points.push_back(Coord(x2,y2));
+   }
+}
+
+// Compares RasterizeLine with the legacy float path for every line that fits on
+// a width x height canvas. The float path only accumulates along the shorter axis,
+// so its result depends on the start coordinate of that axis but not the other
+// one: pinning the longer axis start to an edge covers every distinct case.
+// Only AGI sized canvases match exactly; lines over 160 pixels long let the float
+// error build up far enough to move the odd pixel.
+int CheckLineRasterizer(int width, int height)
+{
+	vector<Coord> expected, actual;
+	int mismatches = 0;
+	long linesChecked = 0;
+	
+	for(int pass = 0; pass < 2; pass++)
+	{
+		bool xMajor = pass == 0;
+		int majorSize = xMajor ? width : height;
+		int minorSize = xMajor ? height : width;
 		
-		default:
-		printf("Uknown command extension: %x\n", commandNumber);
-		exit(1);
-		break;
+		for(int minor1 = 0; minor1 < minorSize; minor1++)
+		{
+			for(int minor2 = 0; minor2 < minorSize; minor2++)
+			{
+				for(int delta = -(majorSize - 1); delta < majorSize; delta++)
+				{
+					// Lines with equal extents belong to the y major branch
+					if(xMajor ? abs(delta) <= abs(minor2 - minor1) : abs(delta) < abs(minor2 - minor1))
+						continue;
+					
+					int major1 = delta < 0 ? majorSize - 1 : 0;
+					int major2 = major1 + delta;
+					int x1 = xMajor ? major1 : minor1, y1 = xMajor ? minor1 : major1;
+					int x2 = xMajor ? major2 : minor2, y2 = xMajor ? minor2 : major2;
+					
+					expected.clear();
+					actual.clear();
+					LegacyRasterizeLine(x1, y1, x2, y2, expected);
+					RasterizeLine(x1, y1, x2, y2, [&actual](int x, int y) { actual.push_back(Coord(x, y)); });
+					linesChecked++;
+					
+					bool match = expected.size() == actual.size();
+					for(size_t n = 0; match && n < expected.size(); n++)
+					{
+						match = expected[n].x == actual[n].x && expected[n].y == actual[n].y;
+					}
+					
+					if(!match)
+					{
+						if(mismatches < 10)
+						{
+							printf("Line (%d, %d) - (%d, %d) differs from the legacy rasterizer\n", x1, y1, x2, y2);
+						}
+						mismatches++;
+					}
+				}
+			}
+		}
+	}
+	
+	printf("Checked %ld lines on a %dx%d canvas: %d mismatches\n", linesChecked, width, height, mismatches);
+	return mismatches;
+}
+
+// Converts one picture file, returning 1 if it could not be converted or
+// did not verify
+int ConvertFile(const char* inputPath, const char* outputPath, int offsetY, bool autoOffset, bool verifyOutput, bool dumpToPng, PrefixCache* cache)
+{
+	FILE* fileStream = fopen(inputPath, "rb");
+	if(!fileStream)
+	{
+		printf("Could not open %s\n", inputPath);
+		return 1;
+	}
+	
+	fseek(fileStream, 0, SEEK_END);
+	pictureDataLength = ftell(fileStream);
+	fseek(fileStream, 0, SEEK_SET);
+	pictureData = new uint8_t[pictureDataLength];
+	fread(pictureData, pictureDataLength, 1, fileStream);
+	fclose(fileStream);
+
+	shared_ptr<vector<SciOp>> ops = make_shared<vector<SciOp>>();
+	bool decoded = DecodePicture(*ops);
+	
+	delete[] pictureData;
+	pictureData = nullptr;
+	
+	if(!decoded)
+	{
+		return 1;
+	}
+	
+	Converter* converter;
+	
+	if(autoOffset)
+	{
+		converter = FindBestOffset(ops, cache);
+		printf("Picked offset %d\n", converter->agiOffsetY);
+	}
+	else
+	{
+		converter = ConvertPicture(ops, offsetY, cache);
+	}
+	
+	if(!WriteFileAtomic(outputPath, converter->Output()))
+	{
+		printf("Could not write %s\n", outputPath);
+		delete converter;
+		return 1;
+	}
+	
+	printf("Data written to %s\n", outputPath);
+	
+	if(minimalPlugs)
+	{
+		printf("Minimal leak plugging saved %d bytes\n", converter->plugBytesSaved);
+	}
+	
+	printf("Fill work: %d fills, %ld pixels visited, %d plugs\n", converter->fillCount, converter->pixelsVisited, converter->plugCount);
+	if(converter->unsealedFills > 0)
+	{
+		if(fastMode)
+			printf("%d fills were not sealed against leaks (--fast)\n", converter->unsealedFills);
+		else
+			printf("Work budget ran out: %d fills were not sealed against leaks\n", converter->unsealedFills);
+	}
+	
+	int result = 0;
+	if(verifyOutput && VerifyOutput(converter->Output(), converter->agiCanvas))
+	{
+		result = 1;
 	}
+
+	// Batches would write every picture over the same files
+	if(dumpToPng)
+	{
+		converter->sciCanvas.DumpToPNG("sci-visual.png", "sci-priority.png");
+		converter->agiCanvas.DumpToPNG("agi-visual.png", "agi-priority.png");
+	}
+	
+	delete converter;
+
+	return result;
 }
 
 int main(int argc, char* argv[])
 {
-	const char* inputPath = nullptr;
+	vector<const char*> inputPaths;
 	const char* outputPath = nullptr;
 	bool dumpToPng = false;
+	bool autoOffset = false;
+	bool verifyOutput = false;
+	int offsetY = 0;
 	
 	for(int arg = 1; arg < argc; arg++)
 	{
@@ -792,27 +4207,63 @@ int main(int argc, char* argv[])
 			}
 			else
 			{
-				printf("No output path specified after -o\n");
+				printf("No output path specified after -o\n");
+				return 1;
+			}
+		}
+		else if(!stricmp(argv[arg], "-d"))
+		{
+			dumpToPng = true;
+		}
+		else if(!stricmp(argv[arg], "-v"))
+		{
+			verbose = true;
+		}
+		else if(!stricmp(argv[arg], "-m"))
+		{
+			minimalPlugs = true;
+		}
+		else if(!stricmp(argv[arg], "--fast"))
+		{
+			fastMode = true;
+		}
+		else if(!stricmp(argv[arg], "-w"))
+		{
+			if(arg + 1 < argc && atol(argv[arg + 1]) > 0)
+			{
+				workBudget = atol(argv[arg + 1]);
+				arg++;
+			}
+			else
+			{
+				printf("Expected number of pixels after -w\n");
 				return 1;
 			}
 		}
-		else if(!stricmp(argv[arg], "-d"))
+		else if(!stricmp(argv[arg], "-c"))
 		{
-			dumpToPng = true;
+			verifyOutput = true;
 		}
-		else if(!stricmp(argv[arg], "-v"))
+		else if(!stricmp(argv[arg], "-l"))
 		{
-			verbose = true;
+			return CheckLineRasterizer(AGI_PICTURE_WIDTH, AGI_PICTURE_HEIGHT) ? 1 : 0;
 		}
 		else if(!stricmp(argv[arg], "-y"))
 		{
 			if(arg + 1 < argc)
 			{
-				AGI_OFFSET_Y = atoi(argv[arg + 1]);
-				if(AGI_OFFSET_Y > 0 || AGI_OFFSET_Y < (168 - 190))
+				if(!stricmp(argv[arg + 1], "auto"))
 				{
-					printf("Offset %d is out of range\n", AGI_OFFSET_Y);
-					return 1;
+					autoOffset = true;
+				}
+				else
+				{
+					offsetY = atoi(argv[arg + 1]);
+					if(offsetY > 0 || offsetY < MIN_AGI_OFFSET_Y)
+					{
+						printf("Offset %d is out of range\n", offsetY);
+						return 1;
+					}
 				}
 				
 				arg++;
@@ -825,369 +4276,456 @@ int main(int argc, char* argv[])
 		}
 		else
 		{
-			if(!inputPath)
-			{
-				inputPath = argv[arg];
-			}
-			else
-			{
-				printf("Unexpected argument %s\n", argv[arg]);
-				return 1;
-			}
+			inputPaths.push_back(argv[arg]);
 		}
 	}
 	
-	if(!inputPath)
+	if(inputPaths.size() > 1 && outputPath)
 	{
-		printf("Usage: pic2pic [options] [input file]\n"
-				"-o [path] To specify output path (default is output.pic)\n"
-				"-d To dump files to PNG\n"
-				"-v verbose mode\n"
-				"-y [value] offset y output\n");
+		printf("-o can only be used with one input file\n");
 		return 1;
 	}
 	
-	if(!outputPath)
-	{
-		outputPath = "output.pic";
-	}
-	
-	FILE* fileStream = fopen(inputPath, "rb");
-	if(!fileStream)
+	if(inputPaths.size() == 0)
 	{
-		printf("Could not open %s\n", inputPath);
+		printf("Usage: pic2pic [options] [input files]\n"
+				"-o [path] To specify output path (default is output.pic, or each input path with .agi added when there are several)\n"
+				"-d To dump files to PNG\n"
+				"-v verbose mode\n"
+				"-y [value] offset y output, or auto to try every offset and keep the best\n"
+				"-m use the minimum number of pixels to plug fill leaks\n"
+				"-l check the line rasterizer against the original float version\n"
+				"-c check the written picture renders the same in pic2png as the converted one\n"
+				"-w [pixels] stop sealing fill leaks once this many pixels have been visited\n"
+				"--fast don't seal fill leaks, for quick previews\n");
 		return 1;
 	}
 	
-	fseek(fileStream, 0, SEEK_END);
-	pictureDataLength = ftell(fileStream);
-	fseek(fileStream, 0, SEEK_SET);
-	pictureData = new uint8_t[pictureDataLength];
-	fread(pictureData, pictureDataLength, 1, fileStream);
-	fclose(fileStream);
-
-	outputFile = fopen(outputPath, "wb");
-	if(!outputFile)
+	InitBrushStamps();
+	InitDitherTable();
+	
+	if(inputPaths.size() == 1)
 	{
-		printf("Could not open file for write\n");
-		return 1;
+		return ConvertFile(inputPaths[0], outputPath ? outputPath : "output.pic", offsetY, autoOffset, verifyOutput, true, nullptr);
 	}
 	
-	pictureDataPtr = pictureData;
+	// Batch conversion, where pictures can pick up from snapshots of earlier ones
+	PrefixCache cache;
+	int result = 0;
 	
-	if(NextWord() != 0x0081)
+	for(const char* path : inputPaths)
 	{
-		printf("Incorrect header: not a SCI picture resource?\n");
-		return 1;
+		string batchOutputPath = string(path) + ".agi";
+		if(ConvertFile(path, batchOutputPath.c_str(), offsetY, autoOffset, verifyOutput, false, &cache))
+		{
+			result = 1;
+		}
 	}
 	
-	bool parsing = true;
+	printf("Resumed %ld of %ld ops from earlier pictures\n", cache.opsResumed, cache.opsResumed + cache.opsRun);
+	
+	return result;
+}
 
-	while(parsing && pictureDataPtr < pictureData + pictureDataLength)
+template<int Width, int Height>
+Canvas<Width, Height>::Canvas(uint8_t priorityBlank, uint8_t visualBlank) : blankPriority(priorityBlank), blankVisual(visualBlank), penColour(COLOUR_DISABLED), priorityColour(COLOUR_DISABLED)
+{
+	// Every page starts out the same, so they can all share one
+	shared_ptr<CanvasPage> blankPage = make_shared<CanvasPage>();
+	blankPage->pixels.assign(width * CANVAS_PAGE_ROWS, (visualBlank & 0xf) | (priorityBlank << 4));
+	
+	for(int plane = 0; plane < 2; plane++)
 	{
-		uint8_t instruction = NextByte();
-		
-		switch((int)instruction)
+		blankPage->blankMasks[plane].assign(maskWords * CANVAS_PAGE_ROWS, 0);
+		for(int row = 0; row < CANVAS_PAGE_ROWS; row++)
 		{
-			case 0xf0:
-			SetVisualColour();
-			break;
-			case 0xf1:
-			DisableVisual();
-			break;
-			case 0xf2:
-			SetPriorityColour();
-			break;
-			case 0xf3:
-			DisablePriority();
-			break;
-			case 0xf4:
-			ShortPatterns();
-			break;
-			case 0xf5:
-			MediumRelativeLines();
-			break;
-			case 0xf6:
-			LongLines();
-			break;
-			case 0xf7:
-			ShortRelativeLines();
-			break;
-			case 0xf8:
-			FloodFill();
-			break;
-			case 0xf9:
-			SetPattern();
-			break;
-			case 0xfa:
-			LongPatterns();
-			break;
-			case 0xfb:
-			SetControlColour();
-			break;
-			case 0xfc:
-			DisableControl();
-			break;
-			case 0xfd:
-			MediumRelativePatterns();
-			break;
-			case 0xfe:
-			CommandExtensions();
-			break;
-			case 0xff:
-			parsing = false;
-			break;
-			
-			default:
-			printf("Unknown instruction! %x\n", instruction);
-			//parsing = false;
-			break;
+			SetMaskRange(blankPage->blankMasks[plane].data() + row * maskWords, 0, width - 1, true);
 		}
 	}
-
-	if(controlLines.size() > 0)
+	
+	for(int n = 0; n < numPages; n++)
 	{
-		EmitAgiInstruction(AGI_DISABLE_VISUAL);
-		EmitAgiInstruction(AGI_SET_PRIORITY);
-		WriteByte(0);
-		
-		for(ControlLine& line : controlLines)
-		{
-			if(line.colour == 0xf)
-			{
-				EmitAgiLine(line.start.x, line.start.y, line.end.x, line.end.y);
-			}
-		}
-
-		EmitAgiInstruction(AGI_SET_PRIORITY);
-		WriteByte(2);
-		for(ControlLine& line : controlLines)
-		{
-			if(line.colour != 0xf)
-			{
-				EmitAgiLine(line.start.x, line.start.y, line.end.x, line.end.y);
-			}
-		}
+		pages[n] = blankPage;
+		SetRowPointers(n);
 	}
-
-	WriteByte(0xff);
-
-	fclose(outputFile);
 	
-	printf("Data written to %s\n", outputPath);
-
-	sciCanvas.DumpToPNG("sci-visual.png", "sci-priority.png");
-	agiCanvas.DumpToPNG("agi-visual.png", "agi-priority.png");
-
-	return 0;
+	for(int plane = 0; plane < 2; plane++)
+	{
+		blankMaskRows[plane][0] = borderMaskRow;
+		blankMaskRows[plane][Height + 1] = borderMaskRow;
+	}
 }
 
-int round(float aNumber, float dirn)
+template<int Width, int Height>
+void Canvas<Width, Height>::SetRowPointers(int pageIndex)
 {
-   if (dirn < 0)
-      return ((aNumber - floor(aNumber) <= 0.501)? floor(aNumber) : ceil(aNumber));
-   return ((aNumber - floor(aNumber) < 0.499)? floor(aNumber) : ceil(aNumber));
+	CanvasPage& page = *pages[pageIndex];
+	
+	for(int row = 0; row < CANVAS_PAGE_ROWS && pageIndex * CANVAS_PAGE_ROWS + row < Height; row++)
+	{
+		int y = pageIndex * CANVAS_PAGE_ROWS + row;
+		pixelRows[y] = page.pixels.data() + row * Width;
+		blankMaskRows[BLANK_VISUAL_PLANE][y + 1] = page.blankMasks[BLANK_VISUAL_PLANE].data() + row * maskWords;
+		blankMaskRows[BLANK_PRIORITY_PLANE][y + 1] = page.blankMasks[BLANK_PRIORITY_PLANE].data() + row * maskWords;
+	}
 }
 
-Canvas::Canvas(int inWidth, int inHeight, uint8_t priorityBlank, uint8_t visualBlank) : width(inWidth), height(inHeight), blankPriority(priorityBlank), blankVisual(visualBlank)
+template<int Width, int Height>
+CanvasPage& Canvas<Width, Height>::WritablePage(int y)
 {
-	visualData = new uint8_t[width * height];
-	priorityData = new uint8_t[width * height];
-	lastVisualData  = new uint8_t[width * height];
-	lastPriorityData = new uint8_t[width * height];
+	int pageIndex = y / CANVAS_PAGE_ROWS;
+	shared_ptr<CanvasPage>& page = pages[pageIndex];
 	
-	for(int n = 0; n < width * height; n++)
+	if(page.use_count() > 1)
 	{
-		visualData[n] = visualBlank;
-		lastVisualData[n] = visualBlank;
-		priorityData[n] = priorityBlank;
-		lastPriorityData[n] = priorityBlank;
+		page = make_shared<CanvasPage>(*page);
+		SetRowPointers(pageIndex);
 	}
-}
 	
-Canvas::~Canvas()
+	return *page;
+}
+
+template<int Width, int Height>
+uint8_t* Canvas<Width, Height>::WritablePixelRow(int y)
+{
+	return WritablePage(y).pixels.data() + (y % CANVAS_PAGE_ROWS) * width;
+}
+
+template<int Width, int Height>
+uint32_t* Canvas<Width, Height>::WritableBlankMaskRow(int plane, int y)
 {
-	delete[] visualData;
-	delete[] priorityData;
-	delete[] lastVisualData;
-	delete[] lastPriorityData;
+	return WritablePage(y).blankMasks[plane].data() + (y % CANVAS_PAGE_ROWS) * maskWords;
 }
 
-void Canvas::SetPixel(int x, int y)
+template<int Width, int Height>
+void Canvas<Width, Height>::SetPixel(int x, int y)
 {
 	if(x >= 0 && y >= 0 && x < width && y < height)
 	{
+		CanvasPage& page = WritablePage(y);
+		int row = y % CANVAS_PAGE_ROWS;
+		int word = row * maskWords + (x >> 5);
+		uint32_t bit = 1u << (x & 31);
+		uint8_t& pixel = page.pixels[row * width + x];
+		
 		if(penColour != COLOUR_DISABLED)
-			visualData[y * width + x] = penColour;
+		{
+			uint32_t& mask = page.blankMasks[BLANK_VISUAL_PLANE][word];
+			pixel = (pixel & 0xf0) | (penColour & 0xf);
+			mask = penColour == blankVisual ? mask | bit : mask & ~bit;
+		}
 		if(priorityColour != COLOUR_DISABLED)
-			priorityData[y * width + x] = priorityColour;
+		{
+			uint32_t& mask = page.blankMasks[BLANK_PRIORITY_PLANE][word];
+			pixel = (pixel & 0x0f) | (priorityColour << 4);
+			mask = priorityColour == blankPriority ? mask | bit : mask & ~bit;
+		}
 	}
 }
 
-uint8_t Canvas::GetVisualPixel(int x, int y)
+template<int Width, int Height>
+uint8_t Canvas<Width, Height>::GetVisualPixel(int x, int y)
 {
 	if(x >= 0 && y >= 0 && x < width && y < height)
 	{
-		return visualData[y * width + x];
+		return PixelRow(y)[x] & 0xf;
 	}
 	return 0;
 }
 
-uint8_t Canvas::GetPriorityPixel(int x, int y)
+template<int Width, int Height>
+uint8_t Canvas<Width, Height>::GetPriorityPixel(int x, int y)
 {
 	if(x >= 0 && y >= 0 && x < width && y < height)
 	{
-		return priorityData[y * width + x];
+		return PixelRow(y)[x] >> 4;
 	}
 	return 0;
 }
 	
-void Canvas::DrawLine(int x1, int y1, int x2, int y2)
+// Works out what the current colours do to a pixel and its blank mask bits
+// once for the whole line. The page being written is only looked up again
+// when the line moves onto another one, and the bounds are checked once
+// from the end points unless the line leaves the canvas.
+template<int Width, int Height>
+void Canvas<Width, Height>::DrawLine(int x1, int y1, int x2, int y2)
 {
-   int height, width, startX, startY;
-   float x, y, addX, addY;
-
-   height = (y2 - y1);
-   width = (x2 - x1);
-   addX = (height==0?height:(float)width/abs(height));
-   addY = (width==0?width:(float)height/abs(width));
-
-   if (abs(width) > abs(height)) 
-   {
-      y = y1;
-      addX = (width == 0? 0 : (width/abs(width)));
-      for (x=x1; x!=x2; x+=addX) 
-	  {
-		SetPixel(round(x, addX), round(y, addY));
-		y += addY;
-      }
-      SetPixel(x2, y2);
-   }
-   else 
-   {
-      x = x1;
-      addY = (height == 0? 0 : (height/abs(height)));
-      for (y=y1; y!=y2; y+=addY) 
-	  {
-		SetPixel(round(x, addX), round(y, addY));
-		x+=addX;
-      }
-      SetPixel(x2,y2);
-   }
-
+	if(x1 < 0 || y1 < 0 || x2 < 0 || y2 < 0 || x1 >= width || y1 >= height || x2 >= width || y2 >= height)
+	{
+		RasterizeLine(x1, y1, x2, y2, [this](int x, int y) { SetPixel(x, y); });
+		return;
+	}
+	
+	uint8_t keep = 0xff;
+	uint8_t value = 0;
+	uint32_t touched[2] = { 0, 0 };
+	uint32_t blank[2] = { 0, 0 };
+	
+	if(penColour != COLOUR_DISABLED)
+	{
+		keep &= 0xf0;
+		value |= penColour & 0xf;
+		touched[BLANK_VISUAL_PLANE] = ~0u;
+		blank[BLANK_VISUAL_PLANE] = penColour == blankVisual ? ~0u : 0;
+	}
+	if(priorityColour != COLOUR_DISABLED)
+	{
+		keep &= 0x0f;
+		value |= priorityColour << 4;
+		touched[BLANK_PRIORITY_PLANE] = ~0u;
+		blank[BLANK_PRIORITY_PLANE] = priorityColour == blankPriority ? ~0u : 0;
+	}
+	
+	if(keep == 0xff)
+		return;
+	
+	int pageIndex = -1;
+	CanvasPage* page = nullptr;
+	
+	RasterizeLine(x1, y1, x2, y2, [&](int x, int y)
+	{
+		if(y / CANVAS_PAGE_ROWS != pageIndex)
+		{
+			pageIndex = y / CANVAS_PAGE_ROWS;
+			page = &WritablePage(y);
+		}
+		
+		int row = y % CANVAS_PAGE_ROWS;
+		int word = row * maskWords + (x >> 5);
+		uint32_t bit = 1u << (x & 31);
+		uint8_t& pixel = page->pixels[row * width + x];
+		uint32_t& visualWord = page->blankMasks[BLANK_VISUAL_PLANE][word];
+		uint32_t& priorityWord = page->blankMasks[BLANK_PRIORITY_PLANE][word];
+		
+		pixel = (pixel & keep) | value;
+		visualWord = (visualWord & ~(bit & touched[BLANK_VISUAL_PLANE])) | (bit & touched[BLANK_VISUAL_PLANE] & blank[BLANK_VISUAL_PLANE]);
+		priorityWord = (priorityWord & ~(bit & touched[BLANK_PRIORITY_PLANE])) | (bit & touched[BLANK_PRIORITY_PLANE] & blank[BLANK_PRIORITY_PLANE]);
+	});
 }
 
-bool Canvas::OkToFill(int x, int y)
+// Sets the pixels of one row where bits has bit n set for x = left + n. The
+// blank masks are updated a word at a time rather than per pixel.
+template<int Width, int Height>
+void Canvas<Width, Height>::StampRow(int left, int y, uint32_t bits)
 {
-	if(penColour == COLOUR_DISABLED && priorityColour == COLOUR_DISABLED)
-		return false;
-	if(penColour == blankVisual)
-		return false;
+	if(y < 0 || y >= height || left >= width || left <= -32)
+		return;
 	
-	if(priorityColour == COLOUR_DISABLED)
+	if(left < 0)
 	{
-		return GetVisualPixel(x, y) == blankVisual;
+		bits >>= -left;
+		left = 0;
 	}
-	else if(priorityColour != COLOUR_DISABLED && penColour == COLOUR_DISABLED)
+	if(width - left < 32)
 	{
-		return GetPriorityPixel(x, y) == blankPriority;
+		bits &= (1u << (width - left)) - 1;
 	}
-	else
+	if(!bits)
+		return;
+	
+	uint64_t wideBits = (uint64_t) bits << (left & 31);
+	uint32_t lowBits = (uint32_t) wideBits;
+	uint32_t highBits = (uint32_t)(wideBits >> 32);
+	CanvasPage& page = WritablePage(y);
+	int row = y % CANVAS_PAGE_ROWS;
+	int word = row * maskWords + (left >> 5);
+	uint8_t keep = 0xff;
+	uint8_t value = 0;
+	
+	if(penColour != COLOUR_DISABLED)
+	{
+		uint32_t* words = page.blankMasks[BLANK_VISUAL_PLANE].data() + word;
+		keep &= 0xf0;
+		value |= penColour & 0xf;
+		if(penColour == blankVisual)
+		{
+			words[0] |= lowBits;
+			if(highBits)
+				words[1] |= highBits;
+		}
+		else
+		{
+			words[0] &= ~lowBits;
+			if(highBits)
+				words[1] &= ~highBits;
+		}
+	}
+	if(priorityColour != COLOUR_DISABLED)
+	{
+		uint32_t* words = page.blankMasks[BLANK_PRIORITY_PLANE].data() + word;
+		keep &= 0x0f;
+		value |= priorityColour << 4;
+		if(priorityColour == blankPriority)
+		{
+			words[0] |= lowBits;
+			if(highBits)
+				words[1] |= highBits;
+		}
+		else
+		{
+			words[0] &= ~lowBits;
+			if(highBits)
+				words[1] &= ~highBits;
+		}
+	}
+	
+	uint8_t* pixels = page.pixels.data() + row * width + left;
+	for(; bits; bits &= bits - 1)
 	{
-		return GetVisualPixel(x, y) == blankVisual;
+		uint8_t& pixel = pixels[LowestSetBit(bits)];
+		pixel = (pixel & keep) | value;
 	}
 }
 
-void Canvas::UndoFill()
+// The blank mask plane that decides whether a pixel can be filled with the
+// current colours, or -1 if nothing can be
+template<int Width, int Height>
+int Canvas<Width, Height>::FillPlane()
 {
-	memcpy(visualData, lastVisualData, width * height);
-	memcpy(priorityData, lastPriorityData, width * height);
+	if(penColour == COLOUR_DISABLED && priorityColour == COLOUR_DISABLED)
+		return -1;
+	if(penColour == blankVisual)
+		return -1;
+	
+	if(priorityColour != COLOUR_DISABLED && penColour == COLOUR_DISABLED)
+	{
+		return BLANK_PRIORITY_PLANE;
+	}
+	return BLANK_VISUAL_PLANE;
 }
 
-void Canvas::Fill(int x, int y, vector<Coord>* filled)
+template<int Width, int Height>
+bool Canvas<Width, Height>::OkToFill(int x, int y)
 {
-	vector<Coord> queue;
-
-	memcpy(lastVisualData, visualData, width * height);
-	memcpy(lastPriorityData, priorityData, width * height);
+	int plane = FillPlane();
+	
+	if(plane < 0 || x < 0 || y < 0 || x >= width || y >= height)
+		return false;
 	
-	queue.push_back(Coord(x, y));
+	return (BlankMaskRow(plane, y)[x >> 5] >> (x & 31)) & 1;
+}
+
+// A priority only fill with the blank priority colour never changes OkToFill
+template<int Width, int Height>
+bool Canvas<Width, Height>::FillHasEffect()
+{
+	return !(penColour == COLOUR_DISABLED && priorityColour == blankPriority);
+}
+
+template<int Width, int Height>
+void Canvas<Width, Height>::Fill(int x, int y, vector<Coord>* filled)
+{
+	vector<Coord> seeds;
 	
 	if(filled)
 	{
 		filled->clear();
 	}
 	
-	while(queue.size() > 0) 
+	if(!FillHasEffect())
+		return;
+	
+	int plane = FillPlane();
+	if(plane < 0 || !OkToFill(x, y))
+		return;
+	
+	uint8_t fillVisual = penColour == COLOUR_DISABLED ? 0 : (penColour & 0xf);
+	uint8_t fillPriority = priorityColour == COLOUR_DISABLED ? 0 : (priorityColour << 4);
+	uint8_t keepMask = (penColour == COLOUR_DISABLED ? 0x0f : 0) | (priorityColour == COLOUR_DISABLED ? 0xf0 : 0);
+	
+	// Scanline fill: each seed is expanded to a full horizontal span, then
+	// one new seed is pushed for every run of fillable pixels above and below.
+	// Spans and runs are found from the blank mask a word at a time.
+	seeds.push_back(Coord(x, y));
+	
+	while(seeds.size() > 0)
 	{
-		Coord coord = queue[0];
-		queue.erase(queue.begin());
-
-		if (OkToFill(coord.x, coord.y)) 
+		Coord seed = seeds.back();
+		seeds.pop_back();
+		
+		const uint32_t* row = BlankMaskRow(plane, seed.y);
+		
+		if(!((row[seed.x >> 5] >> (seed.x & 31)) & 1))
+			continue;
+		
+		int left = FindClearBitBefore(row, seed.x) + 1;
+		int right = FindClearBit(row, seed.x, width) - 1;
+		uint8_t* pixel = WritablePixelRow(seed.y);
+		
+		for(int i = left; i <= right; i++)
 		{
-			SetPixel(coord.x, coord.y);
+			pixel[i] = (pixel[i] & keepMask) | fillVisual | fillPriority;
 			
 			if(filled)
 			{
-				filled->push_back(coord);
+				filled->push_back(Coord(i, seed.y));
 			}
-
-			if ((coord.x != 0) && OkToFill(coord.x - 1, coord.y)) 
-			{
-				queue.push_back(Coord(coord.x - 1, coord.y));
-			}
-			if ((coord.y != 0) && OkToFill(coord.x, coord.y - 1)) 
-			{
-				queue.push_back(Coord(coord.x, coord.y - 1));
-			}
-			if ((coord.x + 1 < width) && OkToFill(coord.x + 1, coord.y)) 
-			{
-				queue.push_back(Coord(coord.x + 1, coord.y));
-			}
-			if ((coord.y + 1 < height) && OkToFill(coord.x, coord.y + 1)) 
+		}
+		
+		if(penColour != COLOUR_DISABLED)
+		{
+			SetMaskRange(WritableBlankMaskRow(BLANK_VISUAL_PLANE, seed.y), left, right, penColour == blankVisual);
+		}
+		if(priorityColour != COLOUR_DISABLED)
+		{
+			SetMaskRange(WritableBlankMaskRow(BLANK_PRIORITY_PLANE, seed.y), left, right, priorityColour == blankPriority);
+		}
+		
+		for(int j = seed.y - 1; j <= seed.y + 1; j += 2)
+		{
+			const uint32_t* nextRow = BlankMaskRow(plane, j);
+			int i = FindSetBit(nextRow, left, right);
+			
+			while(i >= 0)
 			{
-				queue.push_back(Coord(coord.x, coord.y + 1));
+				seeds.push_back(Coord(i, j));
+				
+				int runEnd = FindClearBit(nextRow, i, width);
+				if(runEnd > right)
+					break;
+				i = FindSetBit(nextRow, runEnd, right);
 			}
 		}
 	}
 }
 	
-void Canvas::DumpToPNG(const char* visualFilename, const char* priorityFilename)
+// Pages still shared with the other canvas are known to match without comparing them
+template<int Width, int Height>
+bool Canvas<Width, Height>::SamePixels(const Canvas& other) const
+{
+	for(int n = 0; n < numPages; n++)
+	{
+		if(pages[n] != other.pages[n] && pages[n]->pixels != other.pages[n]->pixels)
+			return false;
+	}
+	return true;
+}
+
+template<int Width, int Height>
+void Canvas<Width, Height>::DumpToPNG(const char* visualFilename, const char* priorityFilename)
 {
-	vector<uint8_t> outputData;
+	vector<uint8_t> outputData(width * height * 4);
 	
 	for(int n = 0; n < width * height; n++)
 	{
-		int index = visualData[n];
-		if(index >= 16)
-		{
-			index = 0;
-		}
-		outputData.push_back(EGAPalette[index * 3]);
-		outputData.push_back(EGAPalette[index * 3 + 1]);
-		outputData.push_back(EGAPalette[index * 3 + 2]);
-		outputData.push_back(0xff);
+		int index = PixelRow(n / width)[n % width] & 0xf;
+		outputData[n * 4] = EGAPalette[index * 3];
+		outputData[n * 4 + 1] = EGAPalette[index * 3 + 1];
+		outputData[n * 4 + 2] = EGAPalette[index * 3 + 2];
+		outputData[n * 4 + 3] = 0xff;
 	}
 	
 	lodepng::encode(visualFilename, outputData, width, height);
 	
-	outputData.clear();
-	
 	for(int n = 0; n < width * height; n++)
 	{
-		int index = priorityData[n];
-		if(index >= 16)
-		{
-			index = 0;
-		}
-		outputData.push_back(EGAPalette[index * 3]);
-		outputData.push_back(EGAPalette[index * 3 + 1]);
-		outputData.push_back(EGAPalette[index * 3 + 2]);
-		outputData.push_back(0xff);
+		int index = PixelRow(n / width)[n % width] >> 4;
+		outputData[n * 4] = EGAPalette[index * 3];
+		outputData[n * 4 + 1] = EGAPalette[index * 3 + 1];
+		outputData[n * 4 + 2] = EGAPalette[index * 3 + 2];
+		outputData[n * 4 + 3] = 0xff;
 	}
 	
 	lodepng::encode(priorityFilename, outputData, width, height);
 
 }
-	
-	
\ No newline at end of file
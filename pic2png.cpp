@@ -62,10 +62,11 @@ struct Bitmap
 	uint8_t clearColour;
 };
 
-/* QUEUE DEFINITIONS */
-
-#define QMAX 8000
-#define EMPTY 0xFFFF
+/* A pixel that a fill carries on from */
+struct FillSeed
+{
+	word x, y;
+};
 
 class PicDrawer
 {
@@ -85,12 +86,10 @@ private:
 	uint8_t getReferencePicture(word x, word y);
 	uint8_t getReferencePriority(word x, word y);
 
-	void qstore(word q);
-	word qretrieve();
 	void pset(word x, word y);
-	int round(float aNumber, float dirn);
 	void drawline(word x1, word y1, word x2, word y2);
 	bool okToFill(word x, word y);
+	bool canFillNext(word x, word y);
 	void agiFill(word x, word y);
 
 	void xCorner(byte** data);
@@ -119,32 +118,11 @@ private:
 
 	uint8_t* lastFill;
 
-	word buf[QMAX + 1];
-	int rpos = QMAX, spos = 0;
+	std::vector<FillSeed> fillSeeds;
 
 	float picScaleX, picScaleY;
 };
 
-void PicDrawer::qstore(word q)
-{
-   if (spos+1==rpos || (spos+1==QMAX && !rpos)) {
-      return;
-   }
-   buf[spos] = q;
-   spos++;
-   if (spos==QMAX) spos = 0;  /* loop back */
-}
-
-word PicDrawer::qretrieve()
-{
-   if (rpos==QMAX) rpos=0;  /* loop back */
-   if (rpos==spos) {
-      return EMPTY;
-   }
-   rpos++;
-   return buf[rpos-1];
-}
-
 void PicDrawer::scaleCoordinates(word& x, word& y)
 {
 	if(x == 159)
@@ -170,53 +148,48 @@ void PicDrawer::pset(word x, word y)
    if (priDrawEnabled) priority->Set(x, y, priColour);
 }
 
-/**************************************************************************
-** round
-**
-** Rounds a float to the closest int. Takes into actions which direction
-** the current line is being drawn when it has a 50:50 decision about
-** where to put a pixel.
-**************************************************************************/
-int PicDrawer::round(float aNumber, float dirn)
-{
-   if (dirn < 0)
-      return ((aNumber - floor(aNumber) <= 0.501)? floor(aNumber) : ceil(aNumber));
-   return ((aNumber - floor(aNumber) < 0.499)? floor(aNumber) : ceil(aNumber));
-}
-
 /**************************************************************************
 ** drawline
 **
-** Draws an AGI line.
+** Draws an AGI line. Steps along the longer axis and carries the shorter
+** one as an integer error term, which picks the same pixels as the AGI
+** interpreter, including rounding ties in the direction of the line.
 **************************************************************************/
 void PicDrawer::drawline(word x1, word y1, word x2, word y2)
 {
 	scaleCoordinates(x1, y1);
 	scaleCoordinates(x2, y2);
 
-   int height, width, startX, startY;
-   float x, y, addX, addY;
+   int width, height, stepX, stepY, error, x, y;
 
-   height = (y2 - y1);
-   width = (x2 - x1);
-   addX = (height==0?height:(float)width/abs(height));
-   addY = (width==0?width:(float)height/abs(width));
+   width = abs(x2 - x1);
+   height = abs(y2 - y1);
+   stepX = (x2 < x1? -1 : 1);
+   stepY = (y2 < y1? -1 : 1);
 
-   if (abs(width) > abs(height)) {
+   if (width > height) {
+      error = width / 2;
       y = y1;
-      addX = (width == 0? 0 : (width/abs(width)));
-      for (x=x1; x!=x2; x+=addX) {
-	 pset(round(x, addX), round(y, addY));
-	 y+=addY;
+      for (x=x1; x!=x2; x+=stepX) {
+	 pset(x, y);
+	 error += height;
+	 if (error >= width) {
+	    error -= width;
+	    y += stepY;
+	 }
       }
       pset(x2,y2);
    }
    else {
+      error = height / 2;
       x = x1;
-      addY = (height == 0? 0 : (height/abs(height)));
-      for (y=y1; y!=y2; y+=addY) {
-	 pset(round(x, addX), round(y, addY));
-	 x+=addX;
+      for (y=y1; y!=y2; y+=stepY) {
+	 pset(x, y);
+	 error += width;
+	 if (error >= height) {
+	    error -= height;
+	    x += stepX;
+	 }
       }
       pset(x2,y2);
    }
@@ -284,13 +257,24 @@ bool PicDrawer::okToFill(word x, word y)
    return true;
 }
 
+/**************************************************************************
+** canFillNext
+**
+** Whether the fill in progress should spread to a pixel. Pixels this fill
+** op already reached are skipped, which also stops a fill that leaves
+** pixels fillable from going round forever.
+**************************************************************************/
+bool PicDrawer::canFillNext(word x, word y)
+{
+   return okToFill(x, y) && !lastFill[y * picture->width + x];
+}
+
 /**************************************************************************
 ** agiFill
 **************************************************************************/
 void PicDrawer::agiFill(word x, word y)
 {
-   word x1, y1;
-   rpos = spos = 0;
+   word left, right, i;
 
    scaleCoordinates(x, y);
 
@@ -350,44 +334,48 @@ void PicDrawer::agiFill(word x, word y)
    //if (referenceDrawer)
 //	   return;
 
-   qstore(x);
-   qstore(y);
+   if (x >= picture->width || y >= picture->height || !canFillNext(x, y))
+      return;
 
-   for (;;) {
+   /* Scanline fill: each seed is widened to the run of fillable pixels on
+      its row, then one seed is pushed for every run touching it above and
+      below. The stack grows as needed, so no fill is ever cut short. */
+   fillSeeds.clear();
+   fillSeeds.push_back({ x, y });
 
-      x1 = qretrieve();
-      y1 = qretrieve();
+   while (!fillSeeds.empty()) {
+      FillSeed seed = fillSeeds.back();
+      fillSeeds.pop_back();
 
-      if ((x1 == EMPTY) || (y1 == EMPTY))
-	 break;
-      else {
+      if (!canFillNext(seed.x, seed.y))
+	 continue;
 
-	 if (okToFill(x1,y1)) {
+      left = right = seed.x;
+      while (left > 0 && canFillNext(left - 1, seed.y))
+	 left--;
+      while (right < picture->width - 1 && canFillNext(right + 1, seed.y))
+	 right++;
 
-	    pset(x1, y1);
-		lastFill[y1 * picture->width + x1] = 1;
+      for (i = left; i <= right; i++) {
+	 pset(i, seed.y);
+	 lastFill[seed.y * picture->width + i] = 1;
+      }
 
-	    if (okToFill(x1, y1-1) && (y1!=0)) {
-	       qstore(x1);
-	       qstore(y1-1);
-	    }
-	    if (okToFill(x1-1, y1) && (x1!=0)) {
-	       qstore(x1-1);
-	       qstore(y1);
-	    }
-	    if (okToFill(x1+1, y1) && (x1!=picture->width - 1)) {
-	       qstore(x1+1);
-	       qstore(y1);
-	    }
-	    if (okToFill(x1, y1+1) && (y1!=picture->height - 1)) {
-	       qstore(x1);
-	       qstore(y1+1);
-	    }
+      for (int row = (int)seed.y - 1; row <= seed.y + 1; row += 2) {
+	 bool inRun = false;
 
-	 }
+	 if (row < 0 || row >= (int)picture->height)
+	    continue;
 
+	 for (i = left; i <= right; i++) {
+	    if (canFillNext(i, (word)row)) {
+	       if (!inRun)
+		  fillSeeds.push_back({ i, (word)row });
+	       inRun = true;
+	    }
+	    else inRun = false;
+	 }
       }
-
    }
 
 }